@@ -102,6 +102,41 @@ typedef struct _XENBUS_EVTCHN_DESCRIPTOR    XENBUS_EVTCHN_DESCRIPTOR, *PXENBUS_E
                          IN PXENBUS_EVTCHN_CONTEXT    Context,                      \
                          IN PXENBUS_EVTCHN_DESCRIPTOR Descriptor                    \
                          )                                                          \
+                         )                                                          \
+        EVTCHN_OPERATION(NTSTATUS,                                                  \
+                         Bind,                                                      \
+                         (                                                          \
+                         IN PXENBUS_EVTCHN_CONTEXT    Context,                      \
+                         IN PXENBUS_EVTCHN_DESCRIPTOR Descriptor,                   \
+                         IN ULONG                     Cpu                           \
+                         )                                                          \
+                         )                                                          \
+        EVTCHN_OPERATION(PXENBUS_EVTCHN_DESCRIPTOR,                                 \
+                         OpenDeferred,                                              \
+                         (                                                          \
+                         IN PXENBUS_EVTCHN_CONTEXT  Context,                        \
+                         IN ULONG                   Cpu,                            \
+                         IN XENBUS_EVTCHN_TYPE      Type,                           \
+                         IN PKSERVICE_ROUTINE       Function,                       \
+                         IN PVOID                   Argument OPTIONAL,              \
+                         ...                                                        \
+                         )                                                          \
+                         )                                                          \
+        EVTCHN_OPERATION(NTSTATUS,                                                  \
+                         Moderate,                                                  \
+                         (                                                          \
+                         IN PXENBUS_EVTCHN_CONTEXT    Context,                      \
+                         IN PXENBUS_EVTCHN_DESCRIPTOR Descriptor,                   \
+                         IN ULONG                     Threshold                     \
+                         )                                                          \
+                         )                                                          \
+        EVTCHN_OPERATION(NTSTATUS,                                                  \
+                         SendMany,                                                  \
+                         (                                                          \
+                         IN PXENBUS_EVTCHN_CONTEXT    Context,                      \
+                         IN PXENBUS_EVTCHN_DESCRIPTOR Descriptor[],                 \
+                         IN ULONG                     Count                         \
+                         )                                                          \
                          )
 
 typedef struct _XENBUS_EVTCHN_CONTEXT   XENBUS_EVTCHN_CONTEXT, *PXENBUS_EVTCHN_CONTEXT;
@@ -131,7 +166,7 @@ DEFINE_GUID(GUID_EVTCHN_INTERFACE,
             0x17,
             0xa6);
 
-#define EVTCHN_INTERFACE_VERSION    4
+#define EVTCHN_INTERFACE_VERSION    8
 
 #define EVTCHN_OPERATIONS(_Interface) \
         (PXENBUS_EVTCHN_OPERATIONS *)((ULONG_PTR)(_Interface))
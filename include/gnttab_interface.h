@@ -35,6 +35,33 @@
 typedef struct _XENBUS_GNTTAB_CACHE         XENBUS_GNTTAB_CACHE, *PXENBUS_GNTTAB_CACHE;
 typedef struct _XENBUS_GNTTAB_DESCRIPTOR    XENBUS_GNTTAB_DESCRIPTOR, *PXENBUS_GNTTAB_DESCRIPTOR;
 
+typedef enum _XENBUS_GNTTAB_COPY_DIRECTION {
+    GNTTAB_COPY_TO_REMOTE = 0,
+    GNTTAB_COPY_FROM_REMOTE
+} XENBUS_GNTTAB_COPY_DIRECTION, *PXENBUS_GNTTAB_COPY_DIRECTION;
+
+// Neither side of a segment may cross a page boundary
+typedef struct _XENBUS_GNTTAB_COPY_SEGMENT {
+    PFN_NUMBER  Pfn;
+    USHORT      Offset;
+    ULONG       Reference;
+    USHORT      RemoteOffset;
+    USHORT      Length;
+    SHORT       Status;     // GNTST_* on return
+} XENBUS_GNTTAB_COPY_SEGMENT, *PXENBUS_GNTTAB_COPY_SEGMENT;
+
+// RevokeForeignAccessDeferred completes a parked revocation from a timer
+// DPC, i.e. at DISPATCH_LEVEL on an arbitrary CPU. The descriptor is
+// returned to the cache with the cache lock acquired (as for Put with
+// Locked == FALSE) and Callback is then invoked in the same context.
+// DestroyCache waits for any revocations still parked on the cache so,
+// if there may be any, it must be called at PASSIVE_LEVEL.
+//
+// PermitForeignAccessPersistent fails with STATUS_INSUFFICIENT_RESOURCES
+// if the cache already holds its maximum number of persistent grants and
+// every one of them is still in use. Callers should then fall back to
+// PermitForeignAccess.
+
 #define DEFINE_GNTTAB_OPERATIONS                                                \
         GNTTAB_OPERATION(VOID,                                                  \
                          Acquire,                                               \
@@ -94,6 +121,89 @@ typedef struct _XENBUS_GNTTAB_DESCRIPTOR    XENBUS_GNTTAB_DESCRIPTOR, *PXENBUS_G
                          IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
                          IN  PXENBUS_GNTTAB_DESCRIPTOR  Descriptor              \
                          )                                                      \
+                         )                                                      \
+        GNTTAB_OPERATION(NTSTATUS,                                              \
+                         PermitForeignAccessMany,                               \
+                         (                                                      \
+                         IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
+                         IN  PXENBUS_GNTTAB_CACHE       Cache,                  \
+                         IN  BOOLEAN                    Locked,                 \
+                         IN  USHORT                     Domain,                 \
+                         IN  PFN_NUMBER                 Pfn[],                  \
+                         IN  BOOLEAN                    ReadOnly,               \
+                         IN  ULONG                      Count,                  \
+                         OUT PXENBUS_GNTTAB_DESCRIPTOR  Descriptor[]            \
+                         )                                                      \
+                         )                                                      \
+        GNTTAB_OPERATION(NTSTATUS,                                              \
+                         RevokeForeignAccessMany,                               \
+                         (                                                      \
+                         IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
+                         IN  PXENBUS_GNTTAB_CACHE       Cache,                  \
+                         IN  BOOLEAN                    Locked,                 \
+                         IN  PXENBUS_GNTTAB_DESCRIPTOR  Descriptor[],           \
+                         IN  ULONG                      Count                   \
+                         )                                                      \
+                         )                                                      \
+        GNTTAB_OPERATION(NTSTATUS,                                              \
+                         RevokeForeignAccessDeferred,                           \
+                         (                                                      \
+                         IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
+                         IN  PXENBUS_GNTTAB_CACHE       Cache,                  \
+                         IN  BOOLEAN                    Locked,                 \
+                         IN  PXENBUS_GNTTAB_DESCRIPTOR  Descriptor,             \
+                         IN  VOID                       (*Callback)(PVOID, NTSTATUS), \
+                         IN  PVOID                      Argument                \
+                         )                                                      \
+                         )                                                      \
+        GNTTAB_OPERATION(NTSTATUS,                                              \
+                         PermitForeignAccessPersistent,                         \
+                         (                                                      \
+                         IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
+                         IN  PXENBUS_GNTTAB_CACHE       Cache,                  \
+                         IN  BOOLEAN                    Locked,                 \
+                         IN  USHORT                     Domain,                 \
+                         IN  PFN_NUMBER                 Pfn,                    \
+                         IN  BOOLEAN                    ReadOnly,               \
+                         OUT PXENBUS_GNTTAB_DESCRIPTOR  *Descriptor             \
+                         )                                                      \
+                         )                                                      \
+        GNTTAB_OPERATION(NTSTATUS,                                              \
+                         RevokeForeignAccessPersistent,                         \
+                         (                                                      \
+                         IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
+                         IN  PXENBUS_GNTTAB_CACHE       Cache,                  \
+                         IN  BOOLEAN                    Locked,                 \
+                         IN  PXENBUS_GNTTAB_DESCRIPTOR  Descriptor              \
+                         )                                                      \
+                         )                                                      \
+        GNTTAB_OPERATION(NTSTATUS,                                              \
+                         Copy,                                                  \
+                         (                                                      \
+                         IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
+                         IN  USHORT                     Domain,                 \
+                         IN  XENBUS_GNTTAB_COPY_DIRECTION Direction,            \
+                         IN  PXENBUS_GNTTAB_COPY_SEGMENT Segment[],             \
+                         IN  ULONG                      Count                   \
+                         )                                                      \
+                         )                                                      \
+        GNTTAB_OPERATION(NTSTATUS,                                              \
+                         MapForeignPages,                                       \
+                         (                                                      \
+                         IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
+                         IN  USHORT                     Domain,                 \
+                         IN  ULONG                      NumberPages,            \
+                         IN  PULONG                     References,             \
+                         IN  BOOLEAN                    ReadOnly,               \
+                         OUT PVOID                      *Address                \
+                         )                                                      \
+                         )                                                      \
+        GNTTAB_OPERATION(NTSTATUS,                                              \
+                         UnmapForeignPages,                                     \
+                         (                                                      \
+                         IN  PXENBUS_GNTTAB_CONTEXT     Context,                \
+                         IN  PVOID                      Address                 \
+                         )                                                      \
                          )
 
 typedef struct _XENBUS_GNTTAB_CONTEXT   XENBUS_GNTTAB_CONTEXT, *PXENBUS_GNTTAB_CONTEXT;
@@ -123,7 +233,7 @@ DEFINE_GUID(GUID_GNTTAB_INTERFACE,
             0xd6,
             0xe);
 
-#define GNTTAB_INTERFACE_VERSION    5
+#define GNTTAB_INTERFACE_VERSION    10
 
 #define GNTTAB_OPERATIONS(_Interface) \
         (PXENBUS_GNTTAB_OPERATIONS *)((ULONG_PTR)(_Interface))
@@ -49,6 +49,7 @@
                               EvtchnPoll,                                                \
                               (                                                          \
                               IN  PXENBUS_SHARED_INFO_CONTEXT Context,                   \
+                              IN  ULONG                       Cpu,                       \
                               IN  BOOLEAN                     (*Function)(PVOID, ULONG), \
                               IN  PVOID                       Argument                   \
                               )                                                          \
@@ -79,6 +80,13 @@
                               (                                                          \
                               IN  PXENBUS_SHARED_INFO_CONTEXT Context                    \
                               )                                                          \
+                              )                                                          \
+        SHARED_INFO_OPERATION(BOOLEAN,                                                   \
+                              UpcallPending,                                             \
+                              (                                                          \
+                              IN  PXENBUS_SHARED_INFO_CONTEXT Context,                   \
+                              IN  ULONG                       Cpu                        \
+                              )                                                          \
                               )
 
 typedef struct _XENBUS_SHARED_INFO_CONTEXT  XENBUS_SHARED_INFO_CONTEXT, *PXENBUS_SHARED_INFO_CONTEXT;
@@ -108,7 +116,7 @@ DEFINE_GUID(GUID_SHARED_INFO_INTERFACE,
             0x78,
             0xb);
 
-#define SHARED_INFO_INTERFACE_VERSION   4
+#define SHARED_INFO_INTERFACE_VERSION   6
 
 #define SHARED_INFO_OPERATIONS(_Interface) \
         (PXENBUS_SHARED_INFO_OPERATIONS *)((ULONG_PTR)(_Interface))
@@ -34,6 +34,8 @@
 
 typedef struct _XENBUS_STORE_TRANSACTION    XENBUS_STORE_TRANSACTION, *PXENBUS_STORE_TRANSACTION;
 typedef struct _XENBUS_STORE_WATCH          XENBUS_STORE_WATCH, *PXENBUS_STORE_WATCH;
+typedef struct _XENBUS_STORE_DIRECTORY      XENBUS_STORE_DIRECTORY, *PXENBUS_STORE_DIRECTORY;
+typedef struct _XENBUS_STORE_PATH           XENBUS_STORE_PATH, *PXENBUS_STORE_PATH;
 
 #define DEFINE_STORE_OPERATIONS                                                 \
         STORE_OPERATION(VOID,                                                   \
@@ -142,6 +144,86 @@ typedef struct _XENBUS_STORE_WATCH          XENBUS_STORE_WATCH, *PXENBUS_STORE_W
                         (                                                       \
                         IN  PXENBUS_STORE_CONTEXT       Context                 \
                         )                                                       \
+                        )                                                       \
+        STORE_OPERATION(NTSTATUS,                                               \
+                        DirectoryOpen,                                          \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context,                \
+                        IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,   \
+                        IN  PCHAR                       Prefix OPTIONAL,        \
+                        IN  PCHAR                       Node,                   \
+                        OUT PXENBUS_STORE_DIRECTORY     *Directory              \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(NTSTATUS,                                               \
+                        DirectoryNext,                                          \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context,                \
+                        IN  PXENBUS_STORE_DIRECTORY     Directory,              \
+                        OUT PCHAR                       *Child                  \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(VOID,                                                   \
+                        DirectoryClose,                                         \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context,                \
+                        IN  PXENBUS_STORE_DIRECTORY     Directory               \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(VOID,                                                   \
+                        BackgroundStart,                                        \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context                 \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(VOID,                                                   \
+                        BackgroundEnd,                                          \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context                 \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(NTSTATUS,                                               \
+                        PathOpen,                                               \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context,                \
+                        IN  PCHAR                       Prefix OPTIONAL,        \
+                        IN  PCHAR                       Node,                   \
+                        OUT PXENBUS_STORE_PATH          *Path                   \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(VOID,                                                   \
+                        PathClose,                                              \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context,                \
+                        IN  PXENBUS_STORE_PATH          Path                    \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(NTSTATUS,                                               \
+                        PathRead,                                               \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context,                \
+                        IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,   \
+                        IN  PXENBUS_STORE_PATH          Path,                   \
+                        OUT PCHAR                       *Value                  \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(NTSTATUS,                                               \
+                        PathWrite,                                              \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context,                \
+                        IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,   \
+                        IN  PXENBUS_STORE_PATH          Path,                   \
+                        IN  PCHAR                       Value                   \
+                        )                                                       \
+                        )                                                       \
+        STORE_OPERATION(NTSTATUS,                                               \
+                        PathWatch,                                              \
+                        (                                                       \
+                        IN  PXENBUS_STORE_CONTEXT       Context,                \
+                        IN  PXENBUS_STORE_PATH          Path,                   \
+                        IN  PKEVENT                     Event,                  \
+                        OUT PXENBUS_STORE_WATCH         *Watch                  \
+                        )                                                       \
                         )
 
 typedef struct _XENBUS_STORE_CONTEXT    XENBUS_STORE_CONTEXT, *PXENBUS_STORE_CONTEXT;
@@ -171,7 +253,7 @@ DEFINE_GUID(GUID_STORE_INTERFACE,
             0xb8,
             0x40);
 
-#define STORE_INTERFACE_VERSION 4
+#define STORE_INTERFACE_VERSION 7
 
 #define STORE_OPERATIONS(_Interface) \
         (PXENBUS_STORE_OPERATIONS *)((ULONG_PTR)(_Interface))
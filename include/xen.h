@@ -88,6 +88,14 @@ HvmPagetableDying(
     IN  PHYSICAL_ADDRESS    Address
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+HvmSetEvtchnUpcallVector(
+    IN  unsigned int    vcpu_id,
+    IN  UCHAR           Vector
+    );
+
 // MEMORY
 
 __checkReturn
@@ -99,6 +107,17 @@ MemoryAddToPhysmap(
     IN  ULONG_PTR   Offset
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+MemoryAddToPhysmapBatch(
+    IN  ULONG       Space,
+    IN  ULONG       Count,
+    IN  PULONG_PTR  OffsetArray,
+    IN  PPFN_NUMBER PfnArray,
+    OUT PLONG       ErrorArray
+    );
+
 __checkReturn
 XEN_API
 ULONG
@@ -156,6 +175,45 @@ EventChannelClose(
     IN  evtchn_port_t   LocalPort
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelBindVirtualCpu(
+    IN  evtchn_port_t   LocalPort,
+    IN  unsigned int    vcpu_id
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelQueryInterDomain(
+    IN  evtchn_port_t   LocalPort,
+    OUT domid_t         *RemoteDomain,
+    OUT evtchn_port_t   *RemotePort
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelReset(
+    VOID
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelInitControl(
+    IN  PFN_NUMBER      Pfn,
+    IN  unsigned int    vcpu_id
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelExpandArray(
+    IN  PFN_NUMBER      Pfn
+    );
+
 // GRANT TABLE
 
 __checkReturn
@@ -172,6 +230,14 @@ GrantTableGetVersion(
     OUT uint32_t    *Version
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableQuerySize(
+    OUT uint32_t    *Current,
+    OUT uint32_t    *Maximum
+    );
+
 __checkReturn
 XEN_API
 NTSTATUS
@@ -180,6 +246,32 @@ GrantTableCopy(
     IN  ULONG               Count
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableMapGrantRef(
+    IN  struct gnttab_map_grant_ref op[],
+    IN  ULONG                       Count
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableUnmapGrantRef(
+    IN  struct gnttab_unmap_grant_ref   op[],
+    IN  ULONG                           Count
+    );
+
+// MULTICALL
+
+__checkReturn
+XEN_API
+NTSTATUS
+Multicall(
+    IN  multicall_entry_t   *Entry,
+    IN  ULONG               Count
+    );
+
 // SCHED
 
 __checkReturn
@@ -212,6 +304,15 @@ ModuleLookup(
     OUT PULONG_PTR  Offset
     );
 
+// SYSTEM
+
+// Maps a Windows processor index to the Xen vcpu_id of that processor
+XEN_API
+ULONG
+SystemVirtualCpuIndex(
+    IN  ULONG   Index
+    );
+
 // LOG
 
 typedef enum _LOG_LEVEL {
@@ -49,7 +49,8 @@ enum xsd_sockmsg_type
     XS_RESUME,
     XS_SET_TARGET,
     XS_RESTRICT,
-    XS_RESET_WATCHES
+    XS_RESET_WATCHES,
+    XS_DIRECTORY_PART
 };
 
 #define XS_WRITE_NONE "NONE"
@@ -106,6 +106,45 @@ fail1:
     return status;
 }
 
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableQuerySize(
+    OUT uint32_t                *Current,
+    OUT uint32_t                *Maximum
+    )
+{
+    struct gnttab_query_size    op;
+    LONG_PTR                    rc;
+    NTSTATUS                    status;
+
+    op.dom = DOMID_SELF;
+
+    rc = GrantTableOp(GNTTABOP_query_size, &op, 1);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    status = STATUS_UNSUCCESSFUL;
+    if (op.status != GNTST_okay)
+        goto fail2;
+
+    *Current = op.nr_frames;
+    *Maximum = op.max_nr_frames;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2 (%d)\n", op.status);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 __checkReturn
 XEN_API
 NTSTATUS
@@ -131,3 +170,55 @@ fail1:
 
     return status;
 }
+
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableMapGrantRef(
+    IN  struct gnttab_map_grant_ref op[],
+    IN  ULONG                       Count
+    )
+{
+    LONG_PTR                        rc;
+    NTSTATUS                        status;
+
+    rc = GrantTableOp(GNTTABOP_map_grant_ref, &op[0], Count);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableUnmapGrantRef(
+    IN  struct gnttab_unmap_grant_ref   op[],
+    IN  ULONG                           Count
+    )
+{
+    LONG_PTR                            rc;
+    NTSTATUS                            status;
+
+    rc = GrantTableOp(GNTTABOP_unmap_grant_ref, &op[0], Count);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
@@ -80,6 +80,58 @@ fail1:
     return status;
 }
 
+__checkReturn
+XEN_API
+NTSTATUS
+MemoryAddToPhysmapBatch(
+    IN  ULONG                           Space,
+    IN  ULONG                           Count,
+    IN  PULONG_PTR                      OffsetArray,
+    IN  PPFN_NUMBER                     PfnArray,
+    OUT PLONG                           ErrorArray
+    )
+{
+    struct xen_add_to_physmap_range     op;
+    ULONG                               Index;
+    LONG_PTR                            rc;
+    NTSTATUS                            status;
+
+    ASSERT3U(Count, <=, MAXUSHORT);
+
+    op.domid = DOMID_SELF;
+    op.space = (uint16_t)Space;
+    op.size = (uint16_t)Count;
+    op.foreign_domid = 0;
+
+    set_xen_guest_handle(op.idxs, OffsetArray);
+    set_xen_guest_handle(op.gpfns, PfnArray);
+    set_xen_guest_handle(op.errs, (int *)ErrorArray);
+
+    rc = MemoryOp(XENMEM_add_to_physmap_range, &op);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    for (Index = 0; Index < Count; Index++) {
+        if (ErrorArray[Index] < 0) {
+            ERRNO_TO_STATUS(-ErrorArray[Index], status);
+            goto fail2;
+        }
+    }
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2 (%u)\n", Index);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 __checkReturn
 XEN_API
 ULONG
@@ -29,6 +29,8 @@
  * SUCH DAMAGE.
  */
 
+#define XEN_API __declspec(dllexport)
+
 #include <ntddk.h>
 #include <ntstrsafe.h>
 #include <stdlib.h>
@@ -45,8 +47,13 @@ typedef struct _SYSTEM_CPU {
     ULONG   Index;
     CHAR    Manufacturer[13];
     UCHAR   ApicID;
+    ULONG   ProcessorID;    // Xen vcpu_id
 } SYSTEM_CPU, *PSYSTEM_CPU;
 
+// Flag in EAX of Xen's HVM CPUID leaf (base + 4) indicating that EBX
+// holds the vcpu_id of the executing CPU
+#define XEN_HVM_CPUID_VCPU_ID_PRESENT   (1u << 3)
+
 typedef struct _SYSTEM_CONTEXT {
     LONG        References;
     SYSTEM_CPU  Cpu[MAXIMUM_PROCESSORS];
@@ -231,6 +238,34 @@ fail1:
     return status;
 }
 
+static FORCEINLINE BOOLEAN
+__SystemGetXenBaseLeaf(
+    OUT PULONG  Leaf
+    )
+{
+    ULONG       EAX;
+    ULONG       EBX;
+    ULONG       ECX;
+    ULONG       EDX;
+
+    // This runs before the hypercall page is set up so the leaf has to
+    // be located here
+    for (*Leaf = 0x40000000; *Leaf <= 0x40000100; *Leaf += 0x100) {
+        CHAR    Signature[13] = {0};
+
+        __CpuId(*Leaf, &EAX, &EBX, &ECX, &EDX);
+        *((PULONG)(Signature + 0)) = EBX;
+        *((PULONG)(Signature + 4)) = ECX;
+        *((PULONG)(Signature + 8)) = EDX;
+
+        if (strcmp(Signature, "XenVMMXenVMM") == 0 &&
+            EAX >= *Leaf + 4)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
 KDEFERRED_ROUTINE   SystemCpuInformation;
 
 VOID
@@ -244,6 +279,8 @@ SystemCpuInformation(
     PSYSTEM_CPU Cpu = Context;
     PKSPIN_LOCK Lock = Argument1;
     PKEVENT     Event = Argument2;
+    ULONG       Leaf;
+    ULONG       EAX;
     ULONG       EBX;
     ULONG       ECX;
     ULONG       EDX;
@@ -272,6 +309,19 @@ SystemCpuInformation(
 
     Info("Local APIC ID: %02X\n", Cpu->ApicID);
 
+    // Windows processor numbering need not match Xen's so, if Xen can
+    // tell us, use the vcpu_id it reports
+    Cpu->ProcessorID = Cpu->Index;
+
+    if (__SystemGetXenBaseLeaf(&Leaf)) {
+        __CpuId(Leaf + 4, &EAX, &EBX, NULL, NULL);
+
+        if (EAX & XEN_HVM_CPUID_VCPU_ID_PRESENT)
+            Cpu->ProcessorID = EBX;
+    }
+
+    Info("vcpu_id: %u\n", Cpu->ProcessorID);
+
     Info("<==== (%u)\n", Cpu->Index);
 
     KeReleaseSpinLockFromDpcLevel(Lock);
@@ -503,6 +553,19 @@ fail1:
     return status;
 }
 
+XEN_API
+ULONG
+SystemVirtualCpuIndex(
+    IN  ULONG       Index
+    )
+{
+    PSYSTEM_CONTEXT Context = &SystemContext;
+
+    ASSERT3U(Index, <, MAXIMUM_PROCESSORS);
+
+    return Context->Cpu[Index].ProcessorID;
+}
+
 extern VOID
 SystemTeardown(
     VOID
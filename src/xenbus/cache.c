@@ -49,9 +49,33 @@ typedef struct _OBJECT_HEADER {
 
 #define OBJECT_HEADER_MAGIC 0x02121996
 
+    ULONG       Index;      // Slot within the slab
     LIST_ENTRY  ListEntry;
 } OBJECT_HEADER, *POBJECT_HEADER;
 
+// With the header and trailer added by __AllocateNonPagedPoolWithTag()
+// a slab of this size takes exactly one page
+#define CACHE_SLAB_SIZE \
+        (PAGE_SIZE - sizeof (NON_PAGED_BUFFER_HEADER) - sizeof (NON_PAGED_BUFFER_TRAILER))
+
+#define CACHE_SLAB_MAXIMUM_OCCUPANCY \
+        (CACHE_SLAB_SIZE / sizeof (OBJECT_HEADER))
+
+// Objects are carved out of slabs, each slot being an OBJECT_HEADER
+// followed by the object, so that small objects are packed densely
+// rather than each taking its own pool allocation
+typedef struct _CACHE_SLAB {
+    ULONG       Magic;
+
+#define CACHE_SLAB_MAGIC    0x42414C53
+
+    LIST_ENTRY  ListEntry;
+    ULONG       CurrentOccupancy;
+    ULONG       MaximumOccupancy;
+    RTL_BITMAP  Allocation;
+    ULONG       Bits[(CACHE_SLAB_MAXIMUM_OCCUPANCY + 31) / 32];
+} CACHE_SLAB, *PCACHE_SLAB;
+
 #define MAXIMUM_SLOTS   6
 
 typedef struct _CACHE_MAGAZINE {
@@ -70,6 +94,12 @@ struct _XENBUS_CACHE {
     LIST_ENTRY      ListEntry;
     CHAR            Name[MAXNAMELEN];
     ULONG           Size;
+    ULONG           SlotSize;
+    ULONG           SlabSize;
+    ULONG           SlabOccupancy;
+    KSPIN_LOCK      SlabLock;
+    LIST_ENTRY      SlabList;   // Slabs with free slots come first
+    LONG            SlabCount;
     ULONG           Reservation;
     NTSTATUS        (*Ctor)(PVOID, PVOID);
     VOID            (*Dtor)(PVOID, PVOID);
@@ -152,6 +182,162 @@ __CacheSwizzle(
     __CacheFill(Cache, List);
 }
 
+// Must be called with the slab lock held
+static NTSTATUS
+__CacheCreateSlab(
+    IN  PXENBUS_CACHE   Cache,
+    OUT PCACHE_SLAB     *Slab
+    )
+{
+    NTSTATUS            status;
+
+    *Slab = __CacheAllocate(Cache->SlabSize);
+
+    status = STATUS_NO_MEMORY;
+    if (*Slab == NULL)
+        goto fail1;
+
+    (*Slab)->Magic = CACHE_SLAB_MAGIC;
+    (*Slab)->MaximumOccupancy = Cache->SlabOccupancy;
+
+    RtlInitializeBitMap(&(*Slab)->Allocation,
+                        (*Slab)->Bits,
+                        (*Slab)->MaximumOccupancy);
+
+    InsertHeadList(&Cache->SlabList, &(*Slab)->ListEntry);
+    Cache->SlabCount++;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Must be called with the slab lock held
+static VOID
+__CacheDestroySlab(
+    IN  PXENBUS_CACHE   Cache,
+    IN  PCACHE_SLAB     Slab
+    )
+{
+    ASSERT3U(Slab->CurrentOccupancy, ==, 0);
+
+    ASSERT(Cache->SlabCount != 0);
+    --Cache->SlabCount;
+
+    RemoveEntryList(&Slab->ListEntry);
+    RtlZeroMemory(&Slab->ListEntry, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(&Slab->Allocation, sizeof (RTL_BITMAP));
+    Slab->MaximumOccupancy = 0;
+    Slab->Magic = 0;
+
+    ASSERT(IsZeroMemory(Slab, Cache->SlabSize));
+    __CacheFree(Slab);
+}
+
+static FORCEINLINE POBJECT_HEADER
+__CacheSlot(
+    IN  PXENBUS_CACHE   Cache,
+    IN  PCACHE_SLAB     Slab,
+    IN  ULONG           Index
+    )
+{
+    return (POBJECT_HEADER)((PUCHAR)(Slab + 1) + ((ULONG_PTR)Index * Cache->SlotSize));
+}
+
+static NTSTATUS
+__CacheGetSlot(
+    IN  PXENBUS_CACHE   Cache,
+    OUT POBJECT_HEADER  *Header
+    )
+{
+    PCACHE_SLAB         Slab;
+    ULONG               Index;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    KeAcquireSpinLock(&Cache->SlabLock, &Irql);
+
+    Slab = NULL;
+
+    if (!IsListEmpty(&Cache->SlabList)) {
+        Slab = CONTAINING_RECORD(Cache->SlabList.Flink, CACHE_SLAB, ListEntry);
+        ASSERT3U(Slab->Magic, ==, CACHE_SLAB_MAGIC);
+
+        if (Slab->CurrentOccupancy == Slab->MaximumOccupancy)
+            Slab = NULL;
+    }
+
+    if (Slab == NULL) {
+        status = __CacheCreateSlab(Cache, &Slab);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+    }
+
+    Index = RtlFindClearBitsAndSet(&Slab->Allocation, 1, 0);
+    ASSERT3U(Index, <, Slab->MaximumOccupancy);
+
+    if (++Slab->CurrentOccupancy == Slab->MaximumOccupancy) {
+        RemoveEntryList(&Slab->ListEntry);
+        InsertTailList(&Cache->SlabList, &Slab->ListEntry);
+    }
+
+    KeReleaseSpinLock(&Cache->SlabLock, Irql);
+
+    *Header = __CacheSlot(Cache, Slab, Index);
+    ASSERT(IsZeroMemory(*Header, Cache->SlotSize));
+
+    (*Header)->Index = Index;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    KeReleaseSpinLock(&Cache->SlabLock, Irql);
+
+    return status;
+}
+
+static VOID
+__CachePutSlot(
+    IN  PXENBUS_CACHE   Cache,
+    IN  POBJECT_HEADER  Header
+    )
+{
+    ULONG               Index = Header->Index;
+    PCACHE_SLAB         Slab;
+    KIRQL               Irql;
+
+    Slab = (PCACHE_SLAB)((PUCHAR)Header - ((ULONG_PTR)Index * Cache->SlotSize)) - 1;
+    ASSERT3U(Slab->Magic, ==, CACHE_SLAB_MAGIC);
+    ASSERT3U(Index, <, Slab->MaximumOccupancy);
+
+    Header->Index = 0;
+    ASSERT(IsZeroMemory(Header, sizeof (OBJECT_HEADER)));
+
+    // The slot must be zero when it is next handed out
+    RtlZeroMemory(Header + 1, Cache->Size);
+
+    KeAcquireSpinLock(&Cache->SlabLock, &Irql);
+
+    ASSERT(RtlCheckBit(&Slab->Allocation, Index));
+    RtlClearBits(&Slab->Allocation, Index, 1);
+
+    if (Slab->CurrentOccupancy-- == Slab->MaximumOccupancy) {
+        RemoveEntryList(&Slab->ListEntry);
+        InsertHeadList(&Cache->SlabList, &Slab->ListEntry);
+    }
+
+    if (Slab->CurrentOccupancy == 0)
+        __CacheDestroySlab(Cache, Slab);
+
+    KeReleaseSpinLock(&Cache->SlabLock, Irql);
+}
+
 static FORCEINLINE NTSTATUS
 __CacheCreateObject(
     IN  PXENBUS_CACHE   Cache,
@@ -161,10 +347,8 @@ __CacheCreateObject(
     PVOID               Object;
     NTSTATUS            status;
 
-    (*Header) = __CacheAllocate(sizeof (OBJECT_HEADER) + Cache->Size);
-
-    status = STATUS_NO_MEMORY;
-    if (*Header == NULL)
+    status = __CacheGetSlot(Cache, Header);
+    if (!NT_SUCCESS(status))
         goto fail1;
 
     (*Header)->Magic = OBJECT_HEADER_MAGIC;
@@ -182,8 +366,7 @@ fail2:
 
     (*Header)->Magic = 0;
 
-    ASSERT(IsZeroMemory(*Header, sizeof (OBJECT_HEADER)));
-    __CacheFree(*Header);
+    __CachePutSlot(Cache, *Header);
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -472,8 +655,7 @@ __CacheDestroyObject(
 
     Header->Magic = 0;
 
-    ASSERT(IsZeroMemory(Header, sizeof (OBJECT_HEADER)));
-    __CacheFree(Header);
+    __CachePutSlot(Cache, Header);
 }
 
 static FORCEINLINE VOID
@@ -560,6 +742,8 @@ __CacheGetFISTEntries(
                                 Cache->Name);
     ASSERT(NT_SUCCESS(status));
 
+    STORE(BackgroundStart, Context->StoreInterface);
+
     status = STORE(Read,
                    Context->StoreInterface,
                    NULL,
@@ -592,6 +776,8 @@ __CacheGetFISTEntries(
               Buffer);
     }
 
+    STORE(BackgroundEnd, Context->StoreInterface);
+
     if (Cache->FIST.Probability > 100)
         Cache->FIST.Probability = 100;
 
@@ -639,6 +825,24 @@ CacheCreate(
         goto fail2;
 
     (*Cache)->Size = Size;
+
+    (*Cache)->SlotSize = (ULONG)P2ROUNDUP(sizeof (OBJECT_HEADER) + Size,
+                                          sizeof (ULONG_PTR));
+    (*Cache)->SlabOccupancy = (ULONG)((CACHE_SLAB_SIZE - sizeof (CACHE_SLAB)) /
+                                      (*Cache)->SlotSize);
+
+    // Objects too big to share a slab get one each
+    if ((*Cache)->SlabOccupancy == 0)
+        (*Cache)->SlabOccupancy = 1;
+
+    ASSERT3U((*Cache)->SlabOccupancy, <=, CACHE_SLAB_MAXIMUM_OCCUPANCY);
+
+    (*Cache)->SlabSize = (ULONG)sizeof (CACHE_SLAB) +
+                         ((*Cache)->SlabOccupancy * (*Cache)->SlotSize);
+
+    KeInitializeSpinLock(&(*Cache)->SlabLock);
+    InitializeListHead(&(*Cache)->SlabList);
+
     (*Cache)->Ctor = Ctor;
     (*Cache)->Dtor = Dtor;
     (*Cache)->AcquireLock = AcquireLock;
@@ -695,6 +899,16 @@ fail3:
     (*Cache)->AcquireLock = NULL;
     (*Cache)->Dtor = NULL;
     (*Cache)->Ctor = NULL;
+
+    ASSERT(IsListEmpty(&(*Cache)->SlabList));
+    ASSERT3U((*Cache)->SlabCount, ==, 0);
+
+    RtlZeroMemory(&(*Cache)->SlabList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Cache)->SlabLock, sizeof (KSPIN_LOCK));
+    (*Cache)->SlabSize = 0;
+    (*Cache)->SlabOccupancy = 0;
+    (*Cache)->SlotSize = 0;
+
     (*Cache)->Size = 0;
 
 fail2:
@@ -751,6 +965,16 @@ CacheDestroy(
     Cache->AcquireLock = NULL;
     Cache->Dtor = NULL;
     Cache->Ctor = NULL;
+
+    ASSERT(IsListEmpty(&Cache->SlabList));
+    ASSERT3U(Cache->SlabCount, ==, 0);
+
+    RtlZeroMemory(&Cache->SlabList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Cache->SlabLock, sizeof (KSPIN_LOCK));
+    Cache->SlabSize = 0;
+    Cache->SlabOccupancy = 0;
+    Cache->SlotSize = 0;
+
     Cache->Size = 0;
 
     RtlZeroMemory(Cache->Name, sizeof (Cache->Name));
@@ -815,12 +1039,14 @@ CacheDebugCallback(
             DEBUG(Printf,
                   Context->DebugInterface,
                   Context->DebugCallback,
-                  "- %s: Allocated = %d (Max = %d) Population = %d (Min = %d)\n",
+                  "- %s: Allocated = %d (Max = %d) Population = %d (Min = %d) Slabs = %d (%u per slab)\n",
                   Cache->Name,
                   Cache->Allocated,
                   Cache->MaximumAllocated,
                   Cache->Population,
-                  Cache->MinimumPopulation);
+                  Cache->MinimumPopulation,
+                  Cache->SlabCount,
+                  Cache->SlabOccupancy);
         }
     }
 }
@@ -35,6 +35,7 @@
 #include <util.h>
 
 #include "evtchn.h"
+#include "evtchn_fifo.h"
 #include "fdo.h"
 #include "dbg_print.h"
 #include "assert.h"
@@ -72,6 +73,18 @@ typedef struct _EVTCHN_PARAMETERS {
 
 #pragma warning(pop)
 
+// Bucket 0 counts callbacks taking less than 1us, bucket N those taking
+// less than 2^N us and the last bucket everything else
+#define EVTCHN_HISTOGRAM_BUCKETS    16
+
+typedef struct _EVTCHN_STATISTICS {
+    ULONG   Upcalls;
+    ULONG   Spurious;
+    LONG    Sends;
+    LONG    UnmaskPending;
+    ULONG   Histogram[EVTCHN_HISTOGRAM_BUCKETS];
+} EVTCHN_STATISTICS, *PEVTCHN_STATISTICS;
+
 #define EVTCHN_DESCRIPTOR_MAGIC 'DTVE'
 
 struct _XENBUS_EVTCHN_DESCRIPTOR {
@@ -84,19 +97,61 @@ struct _XENBUS_EVTCHN_DESCRIPTOR {
     XENBUS_EVTCHN_TYPE                  Type;
     EVTCHN_PARAMETERS                   Parameters;
     ULONG                               LocalPort;
+    ULONG                               Cpu;
+    BOOLEAN                             Deferred;
+    ULONG                               DpcCpu;
+    KDPC                                Dpc;
+    ULONG                               Threshold;
+    ULONGLONG                           WindowStart;
+    ULONG                               WindowEvents;
+    LONG                                Polling; // Interlocked: see EvtchnUnmask()
+    ULONG                               PollCount;
+    ULONG                               Avoided;
+    EVTCHN_STATISTICS                   Statistics;
 };
 
+// Events per period above which a moderated channel switches to polling
+#define EVTCHN_MODERATION_PERIOD    100000ull   // 10ms in 100ns units
+
+// Maximum number of callbacks made by one poll before re-queueing
+#define EVTCHN_POLL_BUDGET          64
+
+typedef enum _EVTCHN_ABI {
+    EVTCHN_ABI_2L = 0,
+    EVTCHN_ABI_FIFO
+} EVTCHN_ABI, *PEVTCHN_ABI;
+
+// The descriptor table is sized for the largest ABI but leaves are only
+// allocated when a port within them is opened
+#define EVTCHN_TABLE_LEAF_SIZE  512
+#define EVTCHN_TABLE_LEAF_COUNT (EVTCHN_FIFO_NR_CHANNELS / EVTCHN_TABLE_LEAF_SIZE)
+
+typedef struct _EVTCHN_UPCALL {
+    PKINTERRUPT InterruptObject;
+    UCHAR       Vector;
+    BOOLEAN     Enabled;
+} EVTCHN_UPCALL, *PEVTCHN_UPCALL;
+
 struct _XENBUS_EVTCHN_CONTEXT {
     LONG                            References;
     PXENBUS_RESOURCE                Interrupt;
     PKINTERRUPT                     InterruptObject;
+    EVTCHN_UPCALL                   Upcall[MAXIMUM_PROCESSORS];
     BOOLEAN                         Enabled;
     PXENBUS_SUSPEND_INTERFACE       SuspendInterface;
     PXENBUS_SUSPEND_CALLBACK        SuspendCallbackEarly;
     PXENBUS_DEBUG_INTERFACE         DebugInterface;
     PXENBUS_DEBUG_CALLBACK          DebugCallback;
     PXENBUS_SHARED_INFO_INTERFACE   SharedInfoInterface;
-    PXENBUS_EVTCHN_DESCRIPTOR       Descriptor[EVTCHN_SELECTOR_COUNT * EVTCHN_PER_SELECTOR];
+    LARGE_INTEGER                   Frequency;
+    LONG                            Bursts;
+    LONG                            BurstSends;
+    LONG                            HypercallsSaved;
+    EVTCHN_ABI                      Abi;
+    PXENBUS_EVTCHN_DESCRIPTOR       *Table[EVTCHN_TABLE_LEAF_COUNT];
+    LONG                            Epoch;
+    LONG                            PollEpoch[MAXIMUM_PROCESSORS];
+    KSPIN_LOCK                      Lock;
     LIST_ENTRY                      List;
 };
 
@@ -146,6 +201,319 @@ __ReleaseInterruptLock(
 
 #pragma warning(pop)
 
+// Events for a vCPU are delivered by its upcall interrupt, if it has one,
+// or by the callback interrupt otherwise
+static FORCEINLINE PKINTERRUPT
+__EvtchnGetInterruptObject(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Cpu
+    )
+{
+    PEVTCHN_UPCALL              Upcall = &Context->Upcall[Cpu];
+
+    return (Upcall->Enabled) ? Upcall->InterruptObject : Context->InterruptObject;
+}
+
+static KIRQL
+__EvtchnAcquireLock(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor,
+    OUT PKINTERRUPT                 *InterruptObject
+    )
+{
+    for (;;) {
+        ULONG   Cpu = Descriptor->Cpu;
+        KIRQL   Irql;
+
+        *InterruptObject = __EvtchnGetInterruptObject(Context, Cpu);
+
+        Irql = __AcquireInterruptLock(*InterruptObject);
+
+        // The channel may have been re-bound, or the vCPU's upcall
+        // interrupt enabled, while we were waiting
+        if (Descriptor->Cpu == Cpu &&
+            __EvtchnGetInterruptObject(Context, Cpu) == *InterruptObject)
+            return Irql;
+
+#pragma prefast(suppress:28121) // The function is not permitted to be called at the current IRQ level
+        __ReleaseInterruptLock(*InterruptObject, Irql);
+    }
+}
+
+static FORCEINLINE VOID
+__EvtchnGetLockOrder(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Cpu,
+    IN  ULONG                   Other,
+    OUT PKINTERRUPT             InterruptObject[2]
+    )
+{
+    InterruptObject[0] = __EvtchnGetInterruptObject(Context, __min(Cpu, Other));
+    InterruptObject[1] = __EvtchnGetInterruptObject(Context, __max(Cpu, Other));
+
+    // The callback interrupt may stand in for several vCPUs so its lock
+    // is always taken first
+    if (InterruptObject[1] == Context->InterruptObject) {
+        InterruptObject[1] = InterruptObject[0];
+        InterruptObject[0] = Context->InterruptObject;
+    }
+}
+
+static VOID
+__EvtchnReleaseLocks(
+    IN  PKINTERRUPT InterruptObject[2],
+    IN  KIRQL       Irql
+    )
+{
+    // All the interrupts share a synchronization IRQL
+    if (InterruptObject[1] != InterruptObject[0])
+#pragma prefast(suppress:28121) // The function is not permitted to be called at the current IRQ level
+        __ReleaseInterruptLock(InterruptObject[1], KeGetCurrentIrql());
+
+#pragma prefast(suppress:28121) // The function is not permitted to be called at the current IRQ level
+    __ReleaseInterruptLock(InterruptObject[0], Irql);
+}
+
+// Acquire the locks covering both the channel's vCPU and another one
+static KIRQL
+__EvtchnAcquireLocks(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor,
+    IN  ULONG                       Other,
+    OUT PKINTERRUPT                 InterruptObject[2]
+    )
+{
+    for (;;) {
+        ULONG       Cpu = Descriptor->Cpu;
+        PKINTERRUPT Check[2];
+        KIRQL       Irql;
+
+        __EvtchnGetLockOrder(Context, Cpu, Other, InterruptObject);
+
+        Irql = __AcquireInterruptLock(InterruptObject[0]);
+        if (InterruptObject[1] != InterruptObject[0])
+            (VOID) __AcquireInterruptLock(InterruptObject[1]);
+
+        __EvtchnGetLockOrder(Context, Cpu, Other, Check);
+
+        if (Descriptor->Cpu == Cpu &&
+            Check[0] == InterruptObject[0] &&
+            Check[1] == InterruptObject[1])
+            return Irql;
+
+        __EvtchnReleaseLocks(InterruptObject, Irql);
+    }
+}
+
+static FORCEINLINE PXENBUS_EVTCHN_DESCRIPTOR
+__EvtchnGetDescriptor(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    PXENBUS_EVTCHN_DESCRIPTOR   *Leaf;
+
+    ASSERT3U(Port, <, EVTCHN_FIFO_NR_CHANNELS);
+
+    Leaf = Context->Table[Port / EVTCHN_TABLE_LEAF_SIZE];
+
+    return (Leaf != NULL) ? Leaf[Port % EVTCHN_TABLE_LEAF_SIZE] : NULL;
+}
+
+static FORCEINLINE VOID
+__EvtchnSetDescriptor(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  ULONG                       Port,
+    IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor
+    )
+{
+    PXENBUS_EVTCHN_DESCRIPTOR       *Leaf;
+
+    ASSERT3U(Port, <, EVTCHN_FIFO_NR_CHANNELS);
+
+    Leaf = Context->Table[Port / EVTCHN_TABLE_LEAF_SIZE];
+    ASSERT(Leaf != NULL);
+
+    // Polls read the table without a lock so the descriptor must be
+    // fully initialized before it becomes visible
+    (VOID) InterlockedExchangePointer((PVOID *)&Leaf[Port % EVTCHN_TABLE_LEAF_SIZE],
+                                      Descriptor);
+}
+
+// A poll records the epoch in which it started. Once the epoch has been
+// advanced past a descriptor's retirement, and every poll is either idle
+// or has started since, nothing can still be using the descriptor.
+static VOID
+__EvtchnSynchronize(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    LONG                        Epoch;
+    ULONG                       Index;
+
+    do {
+        Epoch = InterlockedIncrement(&Context->Epoch);
+    } while (Epoch == 0);
+
+    for (Index = 0; Index < (ULONG)KeNumberProcessors && Index < MAXIMUM_PROCESSORS; Index++) {
+        for (;;) {
+            LONG    PollEpoch;
+
+            PollEpoch = InterlockedCompareExchange(&Context->PollEpoch[Index], 0, 0);
+
+            if (PollEpoch == 0 ||
+                (LONG)((ULONG)PollEpoch - (ULONG)Epoch) >= 0)
+                break;
+
+            _mm_pause();
+        }
+    }
+}
+
+static NTSTATUS
+__EvtchnAllocateLeaf(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    ULONG                       Index;
+    PXENBUS_EVTCHN_DESCRIPTOR   *Leaf;
+
+    ASSERT3U(Port, <, EVTCHN_FIFO_NR_CHANNELS);
+
+    Index = Port / EVTCHN_TABLE_LEAF_SIZE;
+
+    if (Context->Table[Index] != NULL)
+        return STATUS_SUCCESS;
+
+    Leaf = __EvtchnAllocate(sizeof (PXENBUS_EVTCHN_DESCRIPTOR) * EVTCHN_TABLE_LEAF_SIZE);
+    if (Leaf == NULL)
+        return STATUS_NO_MEMORY;
+
+    // Someone else may have beaten us to it
+    if (InterlockedCompareExchangePointer((PVOID *)&Context->Table[Index],
+                                          Leaf,
+                                          NULL) != NULL)
+        __EvtchnFree(Leaf);
+
+    return STATUS_SUCCESS;
+}
+
+static FORCEINLINE const CHAR *
+__EvtchnAbiName(
+    IN  EVTCHN_ABI  Abi
+    )
+{
+#define _EVTCHN_ABI_NAME(_Abi)  \
+    case EVTCHN_ABI_ ## _Abi:   \
+        return #_Abi;
+
+    switch (Abi) {
+    _EVTCHN_ABI_NAME(2L);
+    _EVTCHN_ABI_NAME(FIFO);
+    default:
+        break;
+    }
+
+    return "UNKNOWN";
+
+#undef  _EVTCHN_ABI_NAME
+}
+
+// Use the FIFO ABI if the hypervisor supports it, otherwise fall back
+// to the 2-level ABI implemented by the SHARED_INFO interface
+static VOID
+__EvtchnAbiAcquire(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    NTSTATUS                    status;
+
+    status = EvtchnFifoAcquire();
+
+    Context->Abi = (NT_SUCCESS(status)) ? EVTCHN_ABI_FIFO : EVTCHN_ABI_2L;
+
+    Info("%s\n", __EvtchnAbiName(Context->Abi));
+}
+
+static VOID
+__EvtchnAbiRelease(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    if (Context->Abi == EVTCHN_ABI_FIFO)
+        EvtchnFifoRelease();
+
+    Context->Abi = EVTCHN_ABI_2L;
+}
+
+static FORCEINLINE VOID
+__EvtchnPortReserve(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    // Callers at DISPATCH_LEVEL rely on a page already being spare
+    if (Context->Abi == EVTCHN_ABI_FIFO &&
+        KeGetCurrentIrql() <= APC_LEVEL)
+        (VOID) EvtchnFifoReserve();
+}
+
+static FORCEINLINE NTSTATUS
+__EvtchnPortEnable(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    if (Context->Abi == EVTCHN_ABI_FIFO)
+        return EvtchnFifoPortEnable(Port);
+
+    return (Port < EVTCHN_SELECTOR_COUNT * EVTCHN_PER_SELECTOR) ?
+           STATUS_SUCCESS :
+           STATUS_INVALID_PARAMETER;
+}
+
+static FORCEINLINE VOID
+__EvtchnPortAck(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    if (Context->Abi == EVTCHN_ABI_FIFO)
+        EvtchnFifoPortAck(Port);
+    else
+        SHARED_INFO(EvtchnAck,
+                    Context->SharedInfoInterface,
+                    Port);
+}
+
+static FORCEINLINE VOID
+__EvtchnPortMask(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    if (Context->Abi == EVTCHN_ABI_FIFO)
+        EvtchnFifoPortMask(Port);
+    else
+        SHARED_INFO(EvtchnMask,
+                    Context->SharedInfoInterface,
+                    Port);
+}
+
+static FORCEINLINE BOOLEAN
+__EvtchnPortUnmask(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    if (Context->Abi == EVTCHN_ABI_FIFO)
+        return EvtchnFifoPortUnmask(Port);
+
+    return SHARED_INFO(EvtchnUnmask,
+                       Context->SharedInfoInterface,
+                       Port);
+}
+
 static FORCEINLINE NTSTATUS
 __EvtchnOpenFixed(
     IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor,
@@ -266,21 +634,133 @@ RtlCaptureStackBackTrace(
     __out_opt   PULONG  BackTraceHash
     );
 
+static BOOLEAN
+__EvtchnInvokeCallback(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor
+    )
+{
+    PEVTCHN_STATISTICS              Statistics = &Descriptor->Statistics;
+    LARGE_INTEGER                   Start;
+    LARGE_INTEGER                   End;
+    ULONGLONG                       Microseconds;
+    ULONG                           Bucket;
+    BOOLEAN                         DoneSomething;
+
+    Start = KeQueryPerformanceCounter(NULL);
+
+#pragma prefast(suppress:6387) // Param 1 could be NULL
+    DoneSomething = Descriptor->Callback(NULL, Descriptor->Argument);
+
+    End = KeQueryPerformanceCounter(NULL);
+
+    if (!DoneSomething)
+        Statistics->Spurious++;
+
+    Microseconds = ((End.QuadPart - Start.QuadPart) * 1000000ull) /
+                   Context->Frequency.QuadPart;
+
+    if (Microseconds == 0) {
+        Bucket = 0;
+    } else {
+        ULONG   Bit;
+
+        (VOID) BitScanReverse(&Bit, (ULONG)__min(Microseconds, MAXULONG));
+        Bucket = __min(Bit + 1, EVTCHN_HISTOGRAM_BUCKETS - 1);
+    }
+
+    Statistics->Histogram[Bucket]++;
+
+    return DoneSomething;
+}
+
+static BOOLEAN
+EvtchnUnmask(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor,
+    IN  BOOLEAN                     Locked
+    );
+
+KDEFERRED_ROUTINE   EvtchnDpc;
+
+VOID
+EvtchnDpc(
+    IN  PKDPC                   Dpc,
+    IN  PVOID                   _Context,
+    IN  PVOID                   Argument1,
+    IN  PVOID                   Argument2
+    )
+{
+    PXENBUS_EVTCHN_DESCRIPTOR   Descriptor = _Context;
+    PXENBUS_EVTCHN_CONTEXT      Context = Argument1;
+    ULONG                       Count;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Descriptor != NULL);
+    ASSERT(Context != NULL);
+
+    // The channel may have been deactivated by a suspend since the
+    // DPC was queued
+    if (!Descriptor->Active)
+        return;
+
+    if (!Descriptor->Polling) {
+        (VOID) __EvtchnInvokeCallback(Context, Descriptor);
+        return;
+    }
+
+    // The port is masked so keep calling back until there is nothing
+    // left to do. Each productive call is an interrupt avoided.
+    // EvtchnClose may run concurrently so Active must be re-tested
+    // before each call and before the DPC is re-queued, otherwise it
+    // could be queued again after Close has flushed it.
+    for (Count = 0; Count < EVTCHN_POLL_BUDGET; Count++) {
+        if (!Descriptor->Active)
+            return;
+
+        if (!__EvtchnInvokeCallback(Context, Descriptor))
+            break;
+
+        Descriptor->Avoided++;
+    }
+
+    Descriptor->PollCount++;
+
+    if (Count == EVTCHN_POLL_BUDGET) {
+        if (Descriptor->Active)
+            (VOID) KeInsertQueueDpc(&Descriptor->Dpc, Context, NULL);
+        return;
+    }
+
+    (VOID) InterlockedExchange(&Descriptor->Polling, FALSE);
+
+    // Anything that arrived while masked needs another pass
+    if (EvtchnUnmask(Context, Descriptor, FALSE) &&
+        Descriptor->Active)
+        (VOID) KeInsertQueueDpc(&Descriptor->Dpc, Context, NULL);
+}
+
 static PXENBUS_EVTCHN_DESCRIPTOR
-EvtchnOpen(
+__EvtchnOpen(
     IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PVOID                   Caller,
+    IN  BOOLEAN                 Deferred,
+    IN  ULONG                   Cpu,
     IN  XENBUS_EVTCHN_TYPE      Type,
     IN  PKSERVICE_ROUTINE       Callback,
-    IN  PVOID                   Argument OPTIONAL,
-    ...
+    IN  PVOID                   Argument,
+    IN  va_list                 Arguments
     )
 {
-    va_list                     Arguments;
     PXENBUS_EVTCHN_DESCRIPTOR   Descriptor;
     ULONG                       LocalPort;
     KIRQL                       Irql;
     NTSTATUS                    status;
 
+    __EvtchnPortReserve(Context);
+
     KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
 
     Descriptor = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_DESCRIPTOR));
@@ -290,14 +770,12 @@ EvtchnOpen(
         goto fail1;
 
     Descriptor->Magic = EVTCHN_DESCRIPTOR_MAGIC;
-
-    (VOID) RtlCaptureStackBackTrace(1, 1, &Descriptor->Caller, NULL);    
+    Descriptor->Caller = Caller;
 
     Descriptor->Type = Type;
     Descriptor->Callback = Callback;
     Descriptor->Argument = Argument;
 
-    va_start(Arguments, Argument);
     switch (Type) {
     case EVTCHN_FIXED:
         status = __EvtchnOpenFixed(Descriptor, Arguments);
@@ -319,29 +797,57 @@ EvtchnOpen(
         status = STATUS_INVALID_PARAMETER;
         break;
     }
-    va_end(Arguments);
 
     if (!NT_SUCCESS(status))
         goto fail2;
 
     LocalPort = Descriptor->LocalPort;
 
-    ASSERT3U(LocalPort, <, sizeof (Context->Descriptor) / sizeof (Context->Descriptor[0]));
+    if (Deferred) {
+        KeInitializeDpc(&Descriptor->Dpc, EvtchnDpc, Descriptor);
+        KeSetTargetProcessorDpc(&Descriptor->Dpc, (CCHAR)Cpu);
+
+        Descriptor->DpcCpu = Cpu;
+        Descriptor->Deferred = TRUE;
+    }
 
-    (VOID) __AcquireInterruptLock(Context->InterruptObject);
+    status = __EvtchnPortEnable(Context, LocalPort);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
-    ASSERT3P(Context->Descriptor[LocalPort], ==, NULL);
-    Context->Descriptor[LocalPort] = Descriptor;
-    Descriptor->Active = TRUE;
+    status = __EvtchnAllocateLeaf(Context, LocalPort);
+    if (!NT_SUCCESS(status))
+        goto fail4;
 
+    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
     InsertTailList(&Context->List, &Descriptor->ListEntry);
+    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
 
-    __ReleaseInterruptLock(Context->InterruptObject, DISPATCH_LEVEL);
+    Descriptor->Active = TRUE;
+
+    ASSERT3P(__EvtchnGetDescriptor(Context, LocalPort), ==, NULL);
+    __EvtchnSetDescriptor(Context, LocalPort, Descriptor);
 
     KeLowerIrql(Irql);
 
     return Descriptor;
 
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+    Descriptor->Deferred = FALSE;
+    Descriptor->DpcCpu = 0;
+    RtlZeroMemory(&Descriptor->Dpc, sizeof (KDPC));
+
+    if (Descriptor->Type != EVTCHN_FIXED)
+        (VOID) EventChannelClose(LocalPort);
+
+    Descriptor->LocalPort = 0;
+    RtlZeroMemory(&Descriptor->Parameters, sizeof (EVTCHN_PARAMETERS));
+
 fail2:
     Error("fail2\n");
 
@@ -364,6 +870,77 @@ fail1:
     return NULL;
 }
 
+static PXENBUS_EVTCHN_DESCRIPTOR
+EvtchnOpen(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  XENBUS_EVTCHN_TYPE      Type,
+    IN  PKSERVICE_ROUTINE       Callback,
+    IN  PVOID                   Argument OPTIONAL,
+    ...
+    )
+{
+    va_list                     Arguments;
+    PVOID                       Caller;
+    PXENBUS_EVTCHN_DESCRIPTOR   Descriptor;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    va_start(Arguments, Argument);
+    Descriptor = __EvtchnOpen(Context,
+                              Caller,
+                              FALSE,
+                              0,
+                              Type,
+                              Callback,
+                              Argument,
+                              Arguments);
+    va_end(Arguments);
+
+    return Descriptor;
+}
+
+// The callback is run by a DPC targeted at Cpu, rather than directly
+// from the interrupt.
+static PXENBUS_EVTCHN_DESCRIPTOR
+EvtchnOpenDeferred(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Cpu,
+    IN  XENBUS_EVTCHN_TYPE      Type,
+    IN  PKSERVICE_ROUTINE       Callback,
+    IN  PVOID                   Argument OPTIONAL,
+    ...
+    )
+{
+    va_list                     Arguments;
+    PVOID                       Caller;
+    PXENBUS_EVTCHN_DESCRIPTOR   Descriptor;
+    NTSTATUS                    status;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Cpu >= (ULONG)KeNumberProcessors)
+        goto fail1;
+
+    va_start(Arguments, Argument);
+    Descriptor = __EvtchnOpen(Context,
+                              Caller,
+                              TRUE,
+                              Cpu,
+                              Type,
+                              Callback,
+                              Argument,
+                              Arguments);
+    va_end(Arguments);
+
+    return Descriptor;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return NULL;
+}
+
 #pragma warning(push)
 #pragma warning(disable:4701)
 
@@ -377,19 +954,33 @@ EvtchnUnmask(
     KIRQL                           Irql;
     BOOLEAN                         Pending;
 
+    // Unmasking does not need to be serialized with polls
+    UNREFERENCED_PARAMETER(Locked);
+
     ASSERT3U(Descriptor->Magic, ==, EVTCHN_DESCRIPTOR_MAGIC);
 
-    if (!Locked)
-        Irql = __AcquireInterruptLock(Context->InterruptObject);
+    Pending = FALSE;
 
-    if (Descriptor->Active) {
-        Pending = SHARED_INFO(EvtchnUnmask,
-                              Context->SharedInfoInterface,
-                              Descriptor->LocalPort);
+    // Make sure we don't suspend
+    KeRaiseIrql(__max(KeGetCurrentIrql(), DISPATCH_LEVEL), &Irql);
+
+    // A polled port stays masked until the poll DPC has finished.
+    // Unmasking is not serialized with the ISR, which sets Polling
+    // before it masks the port, so Polling is re-tested once the port
+    // is unmasked and, if the ISR got in first, the port is re-masked.
+    if (Descriptor->Active && !Descriptor->Polling) {
+        Pending = __EvtchnPortUnmask(Context, Descriptor->LocalPort);
+
+        KeMemoryBarrier();
+
+        if (Descriptor->Polling)
+            __EvtchnPortMask(Context, Descriptor->LocalPort);
 
         if (Pending) {
             BOOLEAN Mask;
 
+            (VOID) InterlockedIncrement(&Descriptor->Statistics.UnmaskPending);
+
             switch (Descriptor->Type) {
             case EVTCHN_FIXED:
                 Mask = Descriptor->Parameters.Fixed.Mask;
@@ -413,15 +1004,11 @@ EvtchnUnmask(
             }
 
             if (Mask)
-                SHARED_INFO(EvtchnMask,
-                            Context->SharedInfoInterface,
-                            Descriptor->LocalPort);
+                __EvtchnPortMask(Context, Descriptor->LocalPort);
         }
     }
 
-    if (!Locked)
-#pragma prefast(suppress:28121) // The function is not permitted to be called at the current IRQ level
-        __ReleaseInterruptLock(Context->InterruptObject, Irql);
+    KeLowerIrql(Irql);
 
     return Pending;
 }
@@ -448,6 +1035,8 @@ EvtchnSend(
     if (!Descriptor->Active)
         goto done;
 
+    InterlockedIncrement(&Descriptor->Statistics.Sends);
+
     status = EventChannelSend(Descriptor->LocalPort);
 
 done:
@@ -456,6 +1045,95 @@ done:
     return status;
 }
 
+#define EVTCHN_SEND_BATCH   16
+
+static NTSTATUS
+EvtchnSendMany(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor[],
+    IN  ULONG                       Count
+    )
+{
+    struct evtchn_send              Op[EVTCHN_SEND_BATCH];
+    multicall_entry_t               Entry[EVTCHN_SEND_BATCH];
+    KIRQL                           Irql;
+    ULONG                           Index;
+    NTSTATUS                        status;
+
+    // Make sure we don't suspend
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    status = STATUS_SUCCESS;
+
+    Index = 0;
+    while (Index < Count) {
+        ULONG   Batch;
+        ULONG   Sent;
+
+        Batch = 0;
+        while (Index < Count && Batch < EVTCHN_SEND_BATCH) {
+            PXENBUS_EVTCHN_DESCRIPTOR   Next = Descriptor[Index++];
+
+            ASSERT3U(Next->Magic, ==, EVTCHN_DESCRIPTOR_MAGIC);
+
+            if (!Next->Active) {
+                status = STATUS_UNSUCCESSFUL;
+                continue;
+            }
+
+            InterlockedIncrement(&Next->Statistics.Sends);
+
+            Op[Batch].port = Next->LocalPort;
+
+            Entry[Batch].op = __HYPERVISOR_event_channel_op;
+            Entry[Batch].args[0] = EVTCHNOP_send;
+            Entry[Batch].args[1] = (ULONG_PTR)&Op[Batch];
+            Batch++;
+        }
+
+        if (Batch == 0)
+            break;
+
+        if (Batch == 1) {
+            NTSTATUS    Result;
+
+            Result = EventChannelSend(Op[0].port);
+            if (!NT_SUCCESS(Result))
+                status = Result;
+
+            continue;
+        }
+
+        if (!NT_SUCCESS(Multicall(Entry, Batch))) {
+            // Fall back to sending individually
+            for (Sent = 0; Sent < Batch; Sent++) {
+                NTSTATUS    Result;
+
+                Result = EventChannelSend(Op[Sent].port);
+                if (!NT_SUCCESS(Result))
+                    status = Result;
+            }
+
+            continue;
+        }
+
+        for (Sent = 0; Sent < Batch; Sent++) {
+            LONG_PTR    rc = (LONG_PTR)Entry[Sent].result;
+
+            if (rc < 0)
+                ERRNO_TO_STATUS(-rc, status);
+        }
+
+        InterlockedIncrement(&Context->Bursts);
+        InterlockedExchangeAdd(&Context->BurstSends, Batch);
+        InterlockedExchangeAdd(&Context->HypercallsSaved, Batch - 1);
+    }
+
+    KeLowerIrql(Irql);
+
+    return status;
+}
+
 static FORCEINLINE BOOLEAN
 __EvtchnCallback(
     IN  PXENBUS_EVTCHN_CONTEXT      Context,
@@ -464,13 +1142,32 @@ __EvtchnCallback(
 {
     BOOLEAN                         DoneSomething;
 
-    UNREFERENCED_PARAMETER(Context);
-
     ASSERT(Descriptor != NULL);
     ASSERT(Descriptor->Active);
 
-#pragma prefast(suppress:6387) // Param 1 could be NULL
-    DoneSomething = Descriptor->Callback(NULL, Descriptor->Argument);
+    if (Descriptor->Deferred) {
+        if (Descriptor->Threshold != 0 && !Descriptor->Polling) {
+            ULONGLONG   Now = KeQueryInterruptTime();
+
+            if (Now - Descriptor->WindowStart > EVTCHN_MODERATION_PERIOD) {
+                Descriptor->WindowStart = Now;
+                Descriptor->WindowEvents = 0;
+            }
+
+            if (++Descriptor->WindowEvents > Descriptor->Threshold) {
+                // Polling must be visible before the port is masked
+                // (see EvtchnUnmask())
+                (VOID) InterlockedExchange(&Descriptor->Polling, TRUE);
+                __EvtchnPortMask(Context, Descriptor->LocalPort);
+            }
+        }
+
+        // Events arriving before the DPC runs are coalesced
+        (VOID) KeInsertQueueDpc(&Descriptor->Dpc, Context, NULL);
+        return TRUE;
+    }
+
+    DoneSomething = __EvtchnInvokeCallback(Context, Descriptor);
 
     return DoneSomething;
 }
@@ -481,12 +1178,13 @@ EvtchnTrigger(
     IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor
     )
 {
+    PKINTERRUPT                     InterruptObject;
     KIRQL                           Irql;
     BOOLEAN                         DoneSomething;
 
     ASSERT3U(Descriptor->Magic, ==, EVTCHN_DESCRIPTOR_MAGIC);
 
-    Irql = __AcquireInterruptLock(Context->InterruptObject);
+    Irql = __EvtchnAcquireLock(Context, Descriptor, &InterruptObject);
 
     if (Descriptor->Active) {
         DoneSomething = __EvtchnCallback(Context, Descriptor);
@@ -496,7 +1194,7 @@ EvtchnTrigger(
     }
 
 #pragma prefast(suppress:28121) // The function is not permitted to be called at the current IRQ level
-    __ReleaseInterruptLock(Context->InterruptObject, Irql);
+    __ReleaseInterruptLock(InterruptObject, Irql);
 
     return DoneSomething;
 }
@@ -510,33 +1208,65 @@ EvtchnClose(
     KIRQL                           Irql;
 
     ASSERT3U(Descriptor->Magic, ==, EVTCHN_DESCRIPTOR_MAGIC);
+    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
 
-    Irql = __AcquireInterruptLock(Context->InterruptObject);
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
 
+    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
     RemoveEntryList(&Descriptor->ListEntry);
+    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+
     RtlZeroMemory(&Descriptor->ListEntry, sizeof (LIST_ENTRY));
 
     if (Descriptor->Active) {
         ULONG   LocalPort = Descriptor->LocalPort;
 
-        ASSERT3U(LocalPort, <, sizeof (Context->Descriptor) / sizeof (Context->Descriptor[0]));
-
-        Descriptor->Active = FALSE;
-
-        SHARED_INFO(EvtchnMask,
-                    Context->SharedInfoInterface,
-                    LocalPort);
+        __EvtchnPortMask(Context, LocalPort);
 
         if (Descriptor->Type != EVTCHN_FIXED)
             (VOID) EventChannelClose(LocalPort);
 
-        ASSERT(Context->Descriptor[LocalPort] != NULL);
-        Context->Descriptor[LocalPort] = NULL;
+        ASSERT(__EvtchnGetDescriptor(Context, LocalPort) != NULL);
+        __EvtchnSetDescriptor(Context, LocalPort, NULL);
     }
 
-#pragma prefast(suppress:28121) // The function is not permitted to be called at the current IRQ level
-    __ReleaseInterruptLock(Context->InterruptObject, Irql);
+    KeLowerIrql(Irql);
+
+    // A poll may have found the descriptor just before it was retired.
+    // The descriptor must remain active until any such poll is done.
+    __EvtchnSynchronize(Context);
+
+    Descriptor->Active = FALSE;
+
+    if (Descriptor->Deferred) {
+        // The descriptor can no longer be found by a poll so once any
+        // queued or running DPC has completed it is safe to free it.
+        // A DPC that was already running when Active was cleared may
+        // have re-queued itself, so flush first; any instance still
+        // queued after that will see Active clear and not re-queue.
+        ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
 
+        KeMemoryBarrier();
+
+        KeFlushQueuedDpcs();
+        (VOID) KeRemoveQueueDpc(&Descriptor->Dpc);
+        KeFlushQueuedDpcs();
+
+        Descriptor->Avoided = 0;
+        Descriptor->PollCount = 0;
+        Descriptor->Polling = FALSE;
+        Descriptor->WindowEvents = 0;
+        Descriptor->WindowStart = 0;
+        Descriptor->Threshold = 0;
+
+        RtlZeroMemory(&Descriptor->Dpc, sizeof (KDPC));
+        Descriptor->DpcCpu = 0;
+        Descriptor->Deferred = FALSE;
+    }
+
+    RtlZeroMemory(&Descriptor->Statistics, sizeof (EVTCHN_STATISTICS));
+
+    Descriptor->Cpu = 0;
     Descriptor->LocalPort = 0;
     RtlZeroMemory(&Descriptor->Parameters, sizeof (EVTCHN_PARAMETERS));
 
@@ -552,6 +1282,105 @@ EvtchnClose(
     __EvtchnFree(Descriptor);
 }
 
+static NTSTATUS
+EvtchnBind(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor,
+    IN  ULONG                       Cpu
+    )
+{
+    PKINTERRUPT                     InterruptObject[2];
+    KIRQL                           Irql;
+    NTSTATUS                        status;
+
+    ASSERT3U(Descriptor->Magic, ==, EVTCHN_DESCRIPTOR_MAGIC);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Cpu >= (ULONG)KeNumberProcessors ||
+        SystemVirtualCpuIndex(Cpu) >= XEN_LEGACY_MAX_VCPUS)
+        goto fail1;
+
+    // The callback interrupt is only asserted for events pending on
+    // vCPU 0 so events bound elsewhere would never be seen unless that
+    // vCPU has its own upcall interrupt
+    status = STATUS_NOT_SUPPORTED;
+    if (SystemVirtualCpuIndex(Cpu) != 0 && !Context->Upcall[Cpu].Enabled)
+        goto fail2;
+
+    // Hold both locks so that neither ISR can see the channel half-moved
+    Irql = __EvtchnAcquireLocks(Context, Descriptor, Cpu, InterruptObject);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (!Descriptor->Active)
+        goto fail3;
+
+    if (Descriptor->Cpu == Cpu)
+        goto done;
+
+    status = EventChannelBindVirtualCpu(Descriptor->LocalPort,
+                                        SystemVirtualCpuIndex(Cpu));
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    Descriptor->Cpu = Cpu;
+
+done:
+    __EvtchnReleaseLocks(InterruptObject, Irql);
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+    __EvtchnReleaseLocks(InterruptObject, Irql);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+EvtchnModerate(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_DESCRIPTOR   Descriptor,
+    IN  ULONG                       Threshold
+    )
+{
+    PKINTERRUPT                     InterruptObject;
+    KIRQL                           Irql;
+    NTSTATUS                        status;
+
+    ASSERT3U(Descriptor->Magic, ==, EVTCHN_DESCRIPTOR_MAGIC);
+
+    // Polling is done from the channel's DPC
+    status = STATUS_INVALID_PARAMETER;
+    if (!Descriptor->Deferred)
+        goto fail1;
+
+    Irql = __EvtchnAcquireLock(Context, Descriptor, &InterruptObject);
+
+    Descriptor->Threshold = Threshold;
+    Descriptor->WindowStart = 0;
+    Descriptor->WindowEvents = 0;
+
+#pragma prefast(suppress:28121) // The function is not permitted to be called at the current IRQ level
+    __ReleaseInterruptLock(InterruptObject, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 static ULONG
 EvtchnPort(
     IN  PXENBUS_EVTCHN_CONTEXT      Context,
@@ -603,16 +1432,12 @@ EvtchnPollCallback(
     BOOLEAN                     Mask;
     BOOLEAN                     DoneSomething;
 
-    ASSERT3U(LocalPort, <, sizeof (Context->Descriptor) / sizeof (Context->Descriptor[0]));
-
-    Descriptor = Context->Descriptor[LocalPort];
+    Descriptor = __EvtchnGetDescriptor(Context, LocalPort);
 
     if (Descriptor == NULL) {
         Warning("[%d]: INVALID PORT\n", LocalPort);
 
-        SHARED_INFO(EvtchnMask,
-                    Context->SharedInfoInterface,
-                    LocalPort);
+        __EvtchnPortMask(Context, LocalPort);
 
         DoneSomething = FALSE;
         goto done;
@@ -642,13 +1467,11 @@ EvtchnPollCallback(
     }
 
     if (Mask)
-        SHARED_INFO(EvtchnMask,
-                    Context->SharedInfoInterface,
-                    LocalPort);
+        __EvtchnPortMask(Context, LocalPort);
 
-    SHARED_INFO(EvtchnAck,
-                Context->SharedInfoInterface,
-                LocalPort);
+    __EvtchnPortAck(Context, LocalPort);
+
+    Descriptor->Statistics.Upcalls++;
 
     DoneSomething = __EvtchnCallback(Context, Descriptor);
 
@@ -656,6 +1479,58 @@ done:
     return DoneSomething;
 }
 
+static BOOLEAN
+__EvtchnPoll(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Cpu
+    )
+{
+    BOOLEAN                     DoneSomething;
+
+    // Shared info is indexed by Xen vcpu_id, the FIFO control blocks by
+    // processor index
+    if (Context->Abi != EVTCHN_ABI_FIFO)
+        return SHARED_INFO(EvtchnPoll,
+                           Context->SharedInfoInterface,
+                           SystemVirtualCpuIndex(Cpu),
+                           EvtchnPollCallback,
+                           Context);
+
+    DoneSomething = FALSE;
+
+    while (SHARED_INFO(UpcallPending,
+                       Context->SharedInfoInterface,
+                       SystemVirtualCpuIndex(Cpu)))
+        DoneSomething |= EvtchnFifoPoll(Cpu,
+                                        EvtchnPollCallback,
+                                        Context);
+
+    return DoneSomething;
+}
+
+static BOOLEAN
+__EvtchnPollEpoch(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Cpu
+    )
+{
+    ULONG                       Index;
+    BOOLEAN                     DoneSomething;
+
+    Index = KeGetCurrentProcessorNumber();
+    ASSERT3U(Index, <, MAXIMUM_PROCESSORS);
+
+    // The interrupts share a synchronization IRQL so polls cannot nest
+    ASSERT3U(Context->PollEpoch[Index], ==, 0);
+    (VOID) InterlockedExchange(&Context->PollEpoch[Index], Context->Epoch);
+
+    DoneSomething = __EvtchnPoll(Context, Cpu);
+
+    (VOID) InterlockedExchange(&Context->PollEpoch[Index], 0);
+
+    return DoneSomething;
+}
+
 BOOLEAN
 EvtchnInterrupt(
     IN  PXENBUS_EVTCHN_INTERFACE    Interface
@@ -663,10 +1538,60 @@ EvtchnInterrupt(
 {
     PXENBUS_EVTCHN_CONTEXT          Context = Interface->Context;
 
-    return SHARED_INFO(EvtchnPoll,
-                       Context->SharedInfoInterface,
-                       EvtchnPollCallback,
-                       Context);
+    // Events for vCPU 0 may be arriving on its upcall interrupt instead
+    if (Context->Upcall[0].Enabled)
+        return FALSE;
+
+    return __EvtchnPollEpoch(Context, 0);
+}
+
+BOOLEAN
+EvtchnUpcall(
+    IN  PXENBUS_EVTCHN_INTERFACE    Interface,
+    IN  ULONG                       Cpu
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT          Context = Interface->Context;
+
+    // An upcall vector cannot be cleared so it may still fire after
+    // the interface has been torn down
+    if (Context == NULL || !Context->Upcall[Cpu].Enabled)
+        return FALSE;
+
+    return __EvtchnPollEpoch(Context, Cpu);
+}
+
+// Per-vCPU upcall vectors are only used with the FIFO ABI, which keeps
+// separate event queues for each vCPU. The caller must either hold the
+// callback interrupt lock or be running with everything else quiesced.
+static VOID
+__EvtchnUpcallEnable(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    ULONG                       Cpu;
+
+    for (Cpu = 0; Cpu < (ULONG)KeNumberProcessors && Cpu < MAXIMUM_PROCESSORS; Cpu++) {
+        PEVTCHN_UPCALL  Upcall = &Context->Upcall[Cpu];
+        NTSTATUS        status;
+
+        Upcall->Enabled = FALSE;
+
+        // The pending flag of a vCPU outside the legacy vcpu_info array
+        // cannot be read so such vCPUs are left on the callback interrupt
+        if (Context->Abi != EVTCHN_ABI_FIFO ||
+            Upcall->InterruptObject == NULL ||
+            SystemVirtualCpuIndex(Cpu) >= XEN_LEGACY_MAX_VCPUS)
+            continue;
+
+        // An upcall may be delivered as soon as the vector is set
+        Upcall->Enabled = TRUE;
+
+        status = HvmSetEvtchnUpcallVector(SystemVirtualCpuIndex(Cpu),
+                                          Upcall->Vector);
+        if (!NT_SUCCESS(status))
+            Upcall->Enabled = FALSE;
+    }
 }
 
 static FORCEINLINE VOID
@@ -676,6 +1601,8 @@ __EvtchnInterruptEnable(
 {
     NTSTATUS                    status;
 
+    __EvtchnUpcallEnable(Context);
+
     status = HvmSetParam(HVM_PARAM_CALLBACK_IRQ,
                          Context->Interrupt->Raw.u.Interrupt.Vector);
     ASSERT(NT_SUCCESS(status));
@@ -712,15 +1639,19 @@ EvtchnSuspendCallbackEarly(
         if (Descriptor->Active) {
             ULONG   LocalPort = Descriptor->LocalPort;
 
-            ASSERT3U(LocalPort, <, sizeof (Context->Descriptor) / sizeof (Context->Descriptor[0]));
-
             Descriptor->Active = FALSE;
 
-            ASSERT(Context->Descriptor[LocalPort] != NULL);
-            Context->Descriptor[LocalPort] = NULL;
+            ASSERT(__EvtchnGetDescriptor(Context, LocalPort) != NULL);
+            __EvtchnSetDescriptor(Context, LocalPort, NULL);
         }
     }
 
+    // The new domain starts with the 2-level ABI. Only try to switch
+    // back if we were already using FIFO as its pages are allocated.
+    if (Context->Abi == EVTCHN_ABI_FIFO &&
+        !NT_SUCCESS(EvtchnFifoAcquire()))
+        Context->Abi = EVTCHN_ABI_2L;
+
     if (Context->Enabled)
         __EvtchnInterruptEnable(Context);
 }
@@ -732,9 +1663,46 @@ EvtchnDebugCallback(
     )
 {
     PXENBUS_EVTCHN_CONTEXT      Context = Argument;
+    ULONG                       Cpu;
 
     UNREFERENCED_PARAMETER(Crashing);
 
+    if (Context->Abi == EVTCHN_ABI_FIFO)
+        DEBUG(Printf,
+              Context->DebugInterface,
+              Context->DebugCallback,
+              "ABI: %s (%u EVENT ARRAY PAGE(S))\n",
+              __EvtchnAbiName(Context->Abi),
+              EvtchnFifoArrayPageCount());
+    else
+        DEBUG(Printf,
+              Context->DebugInterface,
+              Context->DebugCallback,
+              "ABI: %s\n",
+              __EvtchnAbiName(Context->Abi));
+
+    for (Cpu = 0; Cpu < (ULONG)KeNumberProcessors && Cpu < MAXIMUM_PROCESSORS; Cpu++) {
+        PEVTCHN_UPCALL  Upcall = &Context->Upcall[Cpu];
+
+        if (!Upcall->Enabled)
+            continue;
+
+        DEBUG(Printf,
+              Context->DebugInterface,
+              Context->DebugCallback,
+              "UPCALL: CPU %u VECTOR %02x\n",
+              Cpu,
+              Upcall->Vector);
+    }
+
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "SEND MANY: BURSTS = %u SENDS = %u HYPERCALLS SAVED = %u\n",
+          Context->Bursts,
+          Context->BurstSends,
+          Context->HypercallsSaved);
+
     if (!IsListEmpty(&Context->List)) {
         PLIST_ENTRY ListEntry;
 
@@ -749,6 +1717,7 @@ EvtchnDebugCallback(
             PXENBUS_EVTCHN_DESCRIPTOR   Descriptor;
             PCHAR                       Name;
             ULONG_PTR                   Offset;
+            ULONG                       Bucket;
 
             Descriptor = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_DESCRIPTOR, ListEntry);
 
@@ -758,19 +1727,21 @@ EvtchnDebugCallback(
                 DEBUG(Printf,
                       Context->DebugInterface,
                       Context->DebugCallback,
-                      "- (%04x) BY %s + %p [%s]\n",
+                      "- (%04x) BY %s + %p [%s] CPU %u\n",
                       Descriptor->LocalPort,
                       Name,
                       (PVOID)Offset,
-                      (Descriptor->Active) ? "TRUE" : "FALSE");
+                      (Descriptor->Active) ? "TRUE" : "FALSE",
+                      Descriptor->Cpu);
             } else {
                 DEBUG(Printf,
                       Context->DebugInterface,
                       Context->DebugCallback,
-                      "- (%04x) BY %p [%s]\n",
+                      "- (%04x) BY %p [%s] CPU %u\n",
                       Descriptor->LocalPort,
                       (PVOID)Descriptor->Caller,
-                      (Descriptor->Active) ? "TRUE" : "FALSE");
+                      (Descriptor->Active) ? "TRUE" : "FALSE",
+                      Descriptor->Cpu);
             }
 
             switch (Descriptor->Type) {
@@ -812,6 +1783,48 @@ EvtchnDebugCallback(
             default:
                 break;
             }
+
+            DEBUG(Printf,
+                  Context->DebugInterface,
+                  Context->DebugCallback,
+                  "STATISTICS: UPCALLS = %u SPURIOUS = %u SENDS = %u UNMASK_PENDING = %u\n",
+                  Descriptor->Statistics.Upcalls,
+                  Descriptor->Statistics.Spurious,
+                  Descriptor->Statistics.Sends,
+                  Descriptor->Statistics.UnmaskPending);
+
+            for (Bucket = 0; Bucket < EVTCHN_HISTOGRAM_BUCKETS; Bucket++) {
+                ULONG   Count = Descriptor->Statistics.Histogram[Bucket];
+
+                if (Count == 0)
+                    continue;
+
+                if (Bucket == EVTCHN_HISTOGRAM_BUCKETS - 1)
+                    DEBUG(Printf,
+                          Context->DebugInterface,
+                          Context->DebugCallback,
+                          "CALLBACK: >= %uus: %u\n",
+                          1u << (Bucket - 1),
+                          Count);
+                else
+                    DEBUG(Printf,
+                          Context->DebugInterface,
+                          Context->DebugCallback,
+                          "CALLBACK: < %uus: %u\n",
+                          1u << Bucket,
+                          Count);
+            }
+
+            if (Descriptor->Deferred)
+                DEBUG(Printf,
+                      Context->DebugInterface,
+                      Context->DebugCallback,
+                      "DEFERRED: Cpu = %u Threshold = %u Polling = %s (POLLS = %u AVOIDED = %u)\n",
+                      Descriptor->DpcCpu,
+                      Descriptor->Threshold,
+                      (Descriptor->Polling) ? "TRUE" : "FALSE",
+                      Descriptor->PollCount,
+                      Descriptor->Avoided);
         }
     }
 }
@@ -823,6 +1836,7 @@ EvtchnInitialize(
     )
 {
     PXENBUS_EVTCHN_CONTEXT          Context;
+    ULONG                           Cpu;
     NTSTATUS                        status;
 
     Trace("====>\n");
@@ -834,14 +1848,29 @@ EvtchnInitialize(
         goto fail1;
 
     InitializeListHead(&Context->List);
+    KeInitializeSpinLock(&Context->Lock);
+
+    Context->Epoch = 1;
+
+    (VOID) KeQueryPerformanceCounter(&Context->Frequency);
 
     Context->SharedInfoInterface = FdoGetSharedInfoInterface(Fdo);
 
     SHARED_INFO(Acquire, Context->SharedInfoInterface);
 
+    __EvtchnAbiAcquire(Context);
+
     Context->Interrupt = FdoGetResource(Fdo, INTERRUPT_RESOURCE);
     Context->InterruptObject = FdoGetInterruptObject(Fdo);
 
+    for (Cpu = 0; Cpu < (ULONG)KeNumberProcessors && Cpu < MAXIMUM_PROCESSORS; Cpu++) {
+        PEVTCHN_UPCALL  Upcall = &Context->Upcall[Cpu];
+
+        Upcall->InterruptObject = FdoGetUpcallInterrupt(Fdo,
+                                                        Cpu,
+                                                        &Upcall->Vector);
+    }
+
     Context->SuspendInterface = FdoGetSuspendInterface(Fdo);
 
     SUSPEND(Acquire, Context->SuspendInterface);
@@ -893,12 +1922,24 @@ fail2:
     Context->SuspendInterface = NULL;
 
     (VOID) HvmSetParam(HVM_PARAM_CALLBACK_IRQ, 0);
+    RtlZeroMemory(Context->Upcall, sizeof (EVTCHN_UPCALL) * MAXIMUM_PROCESSORS);
     Context->InterruptObject = NULL;
     Context->Interrupt = NULL;
 
+    __EvtchnAbiRelease(Context);
+
     SHARED_INFO(Release, Context->SharedInfoInterface);
     Context->SharedInfoInterface = NULL;
 
+    Context->HypercallsSaved = 0;
+    Context->BurstSends = 0;
+    Context->Bursts = 0;
+
+    Context->Frequency.QuadPart = 0;
+
+    Context->Epoch = 0;
+
+    RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
     RtlZeroMemory(&Context->List, sizeof (LIST_ENTRY));
 
     ASSERT(IsZeroMemory(Context, sizeof (XENBUS_EVTCHN_CONTEXT)));
@@ -916,11 +1957,19 @@ EvtchnEnable(
     )
 {
     PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    KIRQL                       Irql;
 
     ASSERT(!Context->Enabled);
 
+    // Switching a vCPU to its upcall interrupt changes which lock covers
+    // its channels
+    Irql = __AcquireInterruptLock(Context->InterruptObject);
+
     __EvtchnInterruptEnable(Context);
     Context->Enabled = TRUE;
+
+#pragma prefast(suppress:28121) // The function is not permitted to be called at the current IRQ level
+    __ReleaseInterruptLock(Context->InterruptObject, Irql);
 }
 
 VOID
@@ -942,6 +1991,7 @@ EvtchnTeardown(
     )
 {
     PXENBUS_EVTCHN_CONTEXT              Context = Interface->Context;
+    ULONG                               Index;
 
     Trace("====>\n");
 
@@ -964,12 +2014,35 @@ EvtchnTeardown(
     SUSPEND(Release, Context->SuspendInterface);
     Context->SuspendInterface = NULL;
 
+    RtlZeroMemory(Context->Upcall, sizeof (EVTCHN_UPCALL) * MAXIMUM_PROCESSORS);
     Context->InterruptObject = NULL;
     Context->Interrupt = NULL;
 
+    for (Index = 0; Index < EVTCHN_TABLE_LEAF_COUNT; Index++) {
+        PXENBUS_EVTCHN_DESCRIPTOR   *Leaf = Context->Table[Index];
+
+        if (Leaf == NULL)
+            continue;
+
+        ASSERT(IsZeroMemory(Leaf, sizeof (PXENBUS_EVTCHN_DESCRIPTOR) * EVTCHN_TABLE_LEAF_SIZE));
+        __EvtchnFree(Leaf);
+        Context->Table[Index] = NULL;
+    }
+
+    __EvtchnAbiRelease(Context);
+
     SHARED_INFO(Release, Context->SharedInfoInterface);
     Context->SharedInfoInterface = NULL;
 
+    Context->HypercallsSaved = 0;
+    Context->BurstSends = 0;
+    Context->Bursts = 0;
+
+    Context->Frequency.QuadPart = 0;
+
+    Context->Epoch = 0;
+
+    RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
     RtlZeroMemory(&Context->List, sizeof (LIST_ENTRY));
 
     ASSERT(IsZeroMemory(Context, sizeof (XENBUS_EVTCHN_CONTEXT)));
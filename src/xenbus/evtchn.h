@@ -57,6 +57,12 @@ EvtchnInterrupt(
     IN  PXENBUS_EVTCHN_INTERFACE    Interface
     );
 
+extern BOOLEAN
+EvtchnUpcall(
+    IN  PXENBUS_EVTCHN_INTERFACE    Interface,
+    IN  ULONG                       Cpu
+    );
+
 extern VOID
 EvtchnEnable(
     IN  PXENBUS_EVTCHN_INTERFACE    Interface
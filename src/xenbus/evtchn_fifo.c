@@ -0,0 +1,561 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <xen.h>
+#include <util.h>
+
+#include "evtchn_fifo.h"
+#include "dbg_print.h"
+#include "assert.h"
+
+#define EVTCHN_FIFO_WORDS_PER_PAGE      (PAGE_SIZE / sizeof (event_word_t))
+#define EVTCHN_FIFO_ARRAY_PAGE_COUNT    (EVTCHN_FIFO_NR_CHANNELS / EVTCHN_FIFO_WORDS_PER_PAGE)
+
+typedef struct _EVTCHN_FIFO_CONTEXT {
+    KSPIN_LOCK                          Lock;
+    ULONG                               Count;
+    PMDL                                ControlBlockMdl[MAXIMUM_PROCESSORS];
+    evtchn_fifo_control_block_t         *ControlBlock[MAXIMUM_PROCESSORS];
+    ULONG                               Head[MAXIMUM_PROCESSORS][EVTCHN_FIFO_MAX_QUEUES];
+    PMDL                                ArrayMdl[EVTCHN_FIFO_ARRAY_PAGE_COUNT];
+    event_word_t                        *Array[EVTCHN_FIFO_ARRAY_PAGE_COUNT];
+    ULONG                               ArrayPageCount;
+} EVTCHN_FIFO_CONTEXT, *PEVTCHN_FIFO_CONTEXT;
+
+// Xen versions prior to 4.6 do not drop FIFO state on EVTCHNOP_reset
+// so pages handed over to Xen are never freed. They are re-used by
+// subsequent acquisitions instead.
+static EVTCHN_FIFO_CONTEXT  EvtchnFifoContext;
+
+static FORCEINLINE PFN_NUMBER
+__EvtchnFifoPfn(
+    IN  PMDL    Mdl
+    )
+{
+    return MmGetMdlPfnArray(Mdl)[0];
+}
+
+static FORCEINLINE volatile event_word_t *
+__EvtchnFifoWord(
+    IN  PEVTCHN_FIFO_CONTEXT    Context,
+    IN  ULONG                   Port
+    )
+{
+    ULONG                       Index;
+
+    Index = Port / EVTCHN_FIFO_WORDS_PER_PAGE;
+    ASSERT3U(Index, <, Context->ArrayPageCount);
+
+    return &Context->Array[Index][Port % EVTCHN_FIFO_WORDS_PER_PAGE];
+}
+
+static FORCEINLINE VOID
+__EvtchnFifoInitializeArrayPage(
+    IN  event_word_t    *Page
+    )
+{
+    ULONG               Index;
+
+    // Ports start masked, as they do with the 2-level ABI
+    for (Index = 0; Index < EVTCHN_FIFO_WORDS_PER_PAGE; Index++)
+        Page[Index] = 1 << EVTCHN_FIFO_MASKED;
+}
+
+static FORCEINLINE BOOLEAN
+__EvtchnFifoTestBit(
+    IN  volatile event_word_t   *Word,
+    IN  ULONG                   Bit
+    )
+{
+    KeMemoryBarrier();
+
+    return (*Word & (1 << Bit)) ? TRUE : FALSE;
+}
+
+static FORCEINLINE BOOLEAN
+__EvtchnFifoSetBit(
+    IN  volatile event_word_t   *Word,
+    IN  ULONG                   Bit
+    )
+{
+    return InterlockedBitTestAndSet((LONG *)Word, Bit);
+}
+
+static FORCEINLINE BOOLEAN
+__EvtchnFifoClearBit(
+    IN  volatile event_word_t   *Word,
+    IN  ULONG                   Bit
+    )
+{
+    return InterlockedBitTestAndReset((LONG *)Word, Bit);
+}
+
+// Atomically clear LINKED and the link, returning the link
+static FORCEINLINE ULONG
+__EvtchnFifoClearLinked(
+    IN  volatile event_word_t   *Word
+    )
+{
+    LONG                        Old;
+    LONG                        New;
+
+    do {
+        Old = *Word;
+        New = Old & ~((1 << EVTCHN_FIFO_LINKED) | EVTCHN_FIFO_LINK_MASK);
+    } while (InterlockedCompareExchange((LONG *)Word, New, Old) != Old);
+
+    return Old & EVTCHN_FIFO_LINK_MASK;
+}
+
+// EVTCHNOP_reset closes every port, including those set up by the
+// toolstack during domain build, so those must be re-bound afterwards.
+static VOID
+__EvtchnFifoReset(
+    VOID
+    )
+{
+    static const ULONG  Parameter[] = {
+        HVM_PARAM_STORE_EVTCHN,
+        HVM_PARAM_CONSOLE_EVTCHN
+    };
+    domid_t             RemoteDomain[ARRAYSIZE(Parameter)];
+    evtchn_port_t       RemotePort[ARRAYSIZE(Parameter)];
+    BOOLEAN             Bound[ARRAYSIZE(Parameter)];
+    ULONG               Index;
+    NTSTATUS            status;
+
+    for (Index = 0; Index < ARRAYSIZE(Parameter); Index++) {
+        ULONG_PTR   Value;
+
+        Bound[Index] = FALSE;
+
+        status = HvmGetParam(Parameter[Index], &Value);
+        if (!NT_SUCCESS(status) || Value == 0)
+            continue;
+
+        status = EventChannelQueryInterDomain((evtchn_port_t)Value,
+                                              &RemoteDomain[Index],
+                                              &RemotePort[Index]);
+        if (!NT_SUCCESS(status))
+            continue;
+
+        Bound[Index] = TRUE;
+    }
+
+    status = EventChannelReset();
+    if (!NT_SUCCESS(status))
+        Error("EVTCHNOP_reset failed (%08x)\n", status);
+
+    for (Index = 0; Index < ARRAYSIZE(Parameter); Index++) {
+        evtchn_port_t   LocalPort;
+
+        if (!Bound[Index])
+            continue;
+
+        status = EventChannelBindInterDomain(RemoteDomain[Index],
+                                             RemotePort[Index],
+                                             &LocalPort);
+        if (!NT_SUCCESS(status)) {
+            Error("PARAM %u: failed to re-bind (%08x)\n",
+                  Parameter[Index],
+                  status);
+            continue;
+        }
+
+        status = HvmSetParam(Parameter[Index], LocalPort);
+        ASSERT(NT_SUCCESS(status));
+
+        Info("PARAM %u: %u:%u -> %u\n",
+             Parameter[Index],
+             RemoteDomain[Index],
+             RemotePort[Index],
+             LocalPort);
+    }
+}
+
+// May be called at HIGH_LEVEL from a suspend callback, in which case
+// all pages must already have been allocated.
+NTSTATUS
+EvtchnFifoAcquire(
+    VOID
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+    ULONG                   Count;
+    ULONG                   Cpu;
+    BOOLEAN                 Retained;
+    NTSTATUS                status;
+
+    KeInitializeSpinLock(&Context->Lock);
+
+    Count = __min((ULONG)KeNumberProcessors, MAXIMUM_PROCESSORS);
+    Retained = FALSE;
+
+    for (Cpu = 0; Cpu < Count; Cpu++) {
+        PMDL    Mdl;
+
+        Mdl = Context->ControlBlockMdl[Cpu];
+        if (Mdl == NULL) {
+            Mdl = __AllocatePage();
+
+            status = STATUS_NO_MEMORY;
+            if (Mdl == NULL)
+                goto fail1;
+
+            Context->ControlBlockMdl[Cpu] = Mdl;
+            Context->ControlBlock[Cpu] = Mdl->MappedSystemVa;
+        }
+
+        RtlZeroMemory(Context->ControlBlock[Cpu], PAGE_SIZE);
+        RtlZeroMemory(Context->Head[Cpu], sizeof (Context->Head[Cpu]));
+
+        status = EventChannelInitControl(__EvtchnFifoPfn(Mdl),
+                                         SystemVirtualCpuIndex(Cpu));
+
+        // If a previous EVTCHNOP_reset did not drop the FIFO state then
+        // Xen will still be using our control blocks and event array.
+        if (status == STATUS_INVALID_PARAMETER &&
+            Cpu < Context->Count &&
+            (Cpu == 0 || Retained)) {
+            Retained = TRUE;
+            continue;
+        }
+
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        status = STATUS_UNSUCCESSFUL;
+        if (Retained)
+            goto fail3;
+    }
+
+    if (Retained) {
+        ULONG   Index;
+
+        // All ports were closed by the reset so nothing can be linked
+        for (Index = 0; Index < Context->ArrayPageCount; Index++)
+            __EvtchnFifoInitializeArrayPage(Context->Array[Index]);
+    } else {
+        Context->ArrayPageCount = 0;
+    }
+
+    Context->Count = Count;
+
+    Info("%u vCPU(s) (%s)\n", Count, (Retained) ? "RETAINED" : "NEW");
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+    // Xen will have switched ABI if any vCPU was initialized
+    if (Cpu != 0)
+        __EvtchnFifoReset();
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+EvtchnFifoRelease(
+    VOID
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+
+    ASSERT(Context->Count != 0);
+
+    __EvtchnFifoReset();
+}
+
+// Pages cannot be allocated at DISPATCH_LEVEL, where ports are
+// enabled, so the next event array page is allocated here beforehand.
+NTSTATUS
+EvtchnFifoReserve(
+    VOID
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+    ULONG                   Index;
+    PMDL                    Mdl;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), <=, APC_LEVEL);
+
+    Index = *(volatile ULONG *)&Context->ArrayPageCount;
+    if (Index >= EVTCHN_FIFO_ARRAY_PAGE_COUNT ||
+        Context->ArrayMdl[Index] != NULL)
+        goto done;
+
+    Mdl = __AllocatePage();
+
+    status = STATUS_NO_MEMORY;
+    if (Mdl == NULL)
+        goto fail1;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    if (Context->ArrayMdl[Index] == NULL) {
+        Context->Array[Index] = Mdl->MappedSystemVa;
+        Context->ArrayMdl[Index] = Mdl;
+        Mdl = NULL;
+    }
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    // Someone else got there first
+    if (Mdl != NULL)
+        __FreePage(Mdl);
+
+done:
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+NTSTATUS
+EvtchnFifoPortEnable(
+    IN  ULONG               Port
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Port >= EVTCHN_FIFO_NR_CHANNELS)
+        goto fail1;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    while (Port >= Context->ArrayPageCount * EVTCHN_FIFO_WORDS_PER_PAGE) {
+        ULONG   Index = Context->ArrayPageCount;
+        PMDL    Mdl;
+
+        // See EvtchnFifoReserve()
+        Mdl = Context->ArrayMdl[Index];
+
+        status = STATUS_NO_MEMORY;
+        if (Mdl == NULL)
+            goto fail2;
+
+        __EvtchnFifoInitializeArrayPage(Context->Array[Index]);
+
+        status = EventChannelExpandArray(__EvtchnFifoPfn(Mdl));
+        if (!NT_SUCCESS(status))
+            goto fail3;
+
+        KeMemoryBarrier();
+
+        Context->ArrayPageCount++;
+    }
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+EvtchnFifoPortAck(
+    IN  ULONG               Port
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+
+    (VOID) __EvtchnFifoClearBit(__EvtchnFifoWord(Context, Port),
+                                EVTCHN_FIFO_PENDING);
+}
+
+VOID
+EvtchnFifoPortMask(
+    IN  ULONG               Port
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+
+    (VOID) __EvtchnFifoSetBit(__EvtchnFifoWord(Context, Port),
+                              EVTCHN_FIFO_MASKED);
+}
+
+// As with the 2-level ABI, a pending event is cleared and TRUE returned
+// so that the caller can deal with it directly.
+BOOLEAN
+EvtchnFifoPortUnmask(
+    IN  ULONG               Port
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+    volatile event_word_t   *Word;
+    BOOLEAN                 Pending;
+    LONG                    Old;
+    LONG                    New;
+
+    Word = __EvtchnFifoWord(Context, Port);
+
+    // Check whether the port is masked
+    if (!__EvtchnFifoTestBit(Word, EVTCHN_FIFO_MASKED))
+        return FALSE;
+
+    // Xen sets BUSY while it is linking the event so wait for it to
+    // finish before clearing MASKED
+    do {
+        Old = *Word & ~(1 << EVTCHN_FIFO_BUSY);
+        New = Old & ~(1 << EVTCHN_FIFO_MASKED);
+    } while (InterlockedCompareExchange((LONG *)Word, New, Old) != Old);
+
+    // An event raised while the port was masked is left pending but not
+    // linked so it must be picked up here. This has to happen after
+    // MASKED is clear, otherwise an event raised in between would be
+    // lost.
+    Pending = __EvtchnFifoClearBit(Word, EVTCHN_FIFO_PENDING);
+
+    return Pending;
+}
+
+static BOOLEAN
+__EvtchnFifoPollPriority(
+    IN  PEVTCHN_FIFO_CONTEXT        Context,
+    IN  ULONG                       Cpu,
+    IN  ULONG                       Priority,
+    IN OUT  PULONG                  Ready,
+    IN  BOOLEAN                     (*Function)(PVOID, ULONG),
+    IN  PVOID                       Argument
+    )
+{
+    evtchn_fifo_control_block_t     *ControlBlock;
+    volatile event_word_t           *Word;
+    ULONG                           Head;
+    ULONG                           Port;
+    BOOLEAN                         DoneSomething;
+
+    ControlBlock = Context->ControlBlock[Cpu];
+
+    Head = Context->Head[Cpu][Priority];
+
+    // If we reached the tail last time then re-read the head
+    if (Head == 0) {
+        KeMemoryBarrier();
+        Head = ControlBlock->head[Priority];
+    }
+
+    Port = Head;
+    Word = __EvtchnFifoWord(Context, Port);
+
+    Head = __EvtchnFifoClearLinked(Word);
+
+    // A zero link means this was the last event in the queue
+    if (Head == 0)
+        *Ready &= ~(1ul << Priority);
+
+    DoneSomething = FALSE;
+
+    if (__EvtchnFifoTestBit(Word, EVTCHN_FIFO_PENDING) &&
+        !__EvtchnFifoTestBit(Word, EVTCHN_FIFO_MASKED))
+        DoneSomething = Function(Argument, Port);
+
+    Context->Head[Cpu][Priority] = Head;
+
+    return DoneSomething;
+}
+
+// Each vCPU has its own control block so this must only be called for
+// a given vCPU by one CPU at a time.
+BOOLEAN
+EvtchnFifoPoll(
+    IN  ULONG               Cpu,
+    IN  BOOLEAN             (*Function)(PVOID, ULONG),
+    IN  PVOID               Argument
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+    evtchn_fifo_control_block_t *ControlBlock;
+    ULONG                   Ready;
+    BOOLEAN                 DoneSomething;
+
+    ASSERT3U(Cpu, <, Context->Count);
+
+    ControlBlock = Context->ControlBlock[Cpu];
+
+    DoneSomething = FALSE;
+
+    Ready = InterlockedExchange((LONG *)&ControlBlock->ready, 0);
+
+    while (Ready != 0) {
+        ULONG   Priority;
+
+        // Lower numbers are higher priorities
+        Priority = (ULONG)__ffs(Ready);
+
+        DoneSomething |= __EvtchnFifoPollPriority(Context,
+                                                  Cpu,
+                                                  Priority,
+                                                  &Ready,
+                                                  Function,
+                                                  Argument);
+
+        Ready |= InterlockedExchange((LONG *)&ControlBlock->ready, 0);
+    }
+
+    return DoneSomething;
+}
+
+ULONG
+EvtchnFifoArrayPageCount(
+    VOID
+    )
+{
+    PEVTCHN_FIFO_CONTEXT    Context = &EvtchnFifoContext;
+
+    return Context->ArrayPageCount;
+}
@@ -0,0 +1,84 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENBUS_EVTCHN_FIFO_H
+#define _XENBUS_EVTCHN_FIFO_H
+
+#include <ntddk.h>
+
+extern NTSTATUS
+EvtchnFifoAcquire(
+    VOID
+    );
+
+extern VOID
+EvtchnFifoRelease(
+    VOID
+    );
+
+extern NTSTATUS
+EvtchnFifoReserve(
+    VOID
+    );
+
+extern NTSTATUS
+EvtchnFifoPortEnable(
+    IN  ULONG   Port
+    );
+
+extern VOID
+EvtchnFifoPortAck(
+    IN  ULONG   Port
+    );
+
+extern VOID
+EvtchnFifoPortMask(
+    IN  ULONG   Port
+    );
+
+extern BOOLEAN
+EvtchnFifoPortUnmask(
+    IN  ULONG   Port
+    );
+
+extern BOOLEAN
+EvtchnFifoPoll(
+    IN  ULONG   Cpu,
+    IN  BOOLEAN (*Function)(PVOID, ULONG),
+    IN  PVOID   Argument
+    );
+
+extern ULONG
+EvtchnFifoArrayPageCount(
+    VOID
+    );
+
+#endif  // _XENBUS_EVTCHN_FIFO_H
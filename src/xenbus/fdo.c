@@ -63,6 +63,13 @@
 
 #define MAXNAMELEN  128
 
+typedef struct _XENBUS_MESSAGE {
+    PXENBUS_FDO         Fdo;
+    ULONG               Cpu;
+    XENBUS_RESOURCE     Resource;
+    PKINTERRUPT         InterruptObject;
+} XENBUS_MESSAGE, *PXENBUS_MESSAGE;
+
 struct _XENBUS_FDO {
     PXENBUS_DX                      Dx;
     PDEVICE_OBJECT                  LowerDeviceObject;
@@ -99,6 +106,7 @@ struct _XENBUS_FDO {
 
     XENBUS_RESOURCE                 Resource[RESOURCE_COUNT];
     PKINTERRUPT                     InterruptObject;
+    XENBUS_MESSAGE                  Message[MAXIMUM_PROCESSORS];
 
     PXENFILT_UNPLUG_INTERFACE       UnplugInterface;
     XENBUS_SUSPEND_INTERFACE        SuspendInterface;
@@ -915,6 +923,7 @@ FdoScan(
         }
 
         STORE(Acquire, &Fdo->StoreInterface);
+        STORE(BackgroundStart, &Fdo->StoreInterface);
 
         status = STORE(Directory,
                        &Fdo->StoreInterface,
@@ -1001,6 +1010,7 @@ FdoScan(
         }
 
 loop:
+        STORE(BackgroundEnd, &Fdo->StoreInterface);
         STORE(Release, &Fdo->StoreInterface);
 
         KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
@@ -1248,6 +1258,7 @@ FdoBalloon(
         }
 
         STORE(Acquire, &Fdo->StoreInterface);
+        STORE(BackgroundStart, &Fdo->StoreInterface);
 
         if (!Initialized) {
             ULONGLONG   VideoRAM;
@@ -1383,6 +1394,7 @@ FdoBalloon(
         __FdoBalloonClearActive(Fdo);
 
 loop:
+        STORE(BackgroundEnd, &Fdo->StoreInterface);
         STORE(Release, &Fdo->StoreInterface);
 
         if (!Active)
@@ -1469,6 +1481,31 @@ FdoParseResources(
                   TranslatedPartialDescriptor->u.Interrupt.Vector,
                   (PVOID)TranslatedPartialDescriptor->u.Interrupt.Affinity);
 
+            if (TranslatedPartialDescriptor->Flags & CM_RESOURCE_INTERRUPT_MESSAGE) {
+                KAFFINITY       Affinity;
+                ULONG           Cpu;
+                PXENBUS_MESSAGE Message;
+
+                // Each message was requested for a single processor
+                Affinity = TranslatedPartialDescriptor->u.Interrupt.Affinity;
+
+                for (Cpu = 0; Cpu < MAXIMUM_PROCESSORS; Cpu++)
+                    if (Affinity & ((KAFFINITY)1 << Cpu))
+                        break;
+
+                if (Cpu == MAXIMUM_PROCESSORS)
+                    break;
+
+                Message = &Fdo->Message[Cpu];
+
+                Message->Fdo = Fdo;
+                Message->Cpu = Cpu;
+                Message->Resource.Raw = *RawPartialDescriptor;
+                Message->Resource.Translated = *TranslatedPartialDescriptor;
+
+                break;
+            }
+
             Fdo->Resource[INTERRUPT_RESOURCE].Raw = *RawPartialDescriptor;
             Fdo->Resource[INTERRUPT_RESOURCE].Translated = *TranslatedPartialDescriptor;
 
@@ -1547,22 +1584,65 @@ FdoGetInterruptObject(
     return __FdoGetInterruptObject(Fdo);
 }
 
+KSERVICE_ROUTINE    FdoUpcall;
+
+BOOLEAN
+FdoUpcall(
+    IN  PKINTERRUPT         InterruptObject,
+    IN  PVOID               Context
+    )
+{
+    PXENBUS_MESSAGE         Message = Context;
+    PXENBUS_FDO             Fdo;
+    BOOLEAN                 DoneSomething;
+
+    UNREFERENCED_PARAMETER(InterruptObject);
+
+    ASSERT(Message != NULL);
+    Fdo = Message->Fdo;
+
+    DoneSomething = EvtchnUpcall(&Fdo->EvtchnInterface, Message->Cpu);
+
+    return DoneSomething;
+}
+
+PKINTERRUPT
+FdoGetUpcallInterrupt(
+    IN  PXENBUS_FDO Fdo,
+    IN  ULONG       Cpu,
+    OUT PUCHAR      Vector
+    )
+{
+    PXENBUS_MESSAGE Message;
+
+    ASSERT3U(Cpu, <, MAXIMUM_PROCESSORS);
+    Message = &Fdo->Message[Cpu];
+
+    if (Message->InterruptObject == NULL)
+        return NULL;
+
+    *Vector = (UCHAR)Message->Resource.Translated.u.Interrupt.Vector;
+
+    return Message->InterruptObject;
+}
+
 static NTSTATUS
-FdoConnectInterrupt(
-    IN  PXENBUS_FDO                 Fdo
+__FdoConnectInterrupt(
+    IN  PXENBUS_FDO                 Fdo,
+    IN  PXENBUS_RESOURCE            Interrupt,
+    IN  KIRQL                       SynchronizeIrql,
+    IN  PKSERVICE_ROUTINE           ServiceRoutine,
+    IN  PVOID                       ServiceContext,
+    OUT PKINTERRUPT                 *InterruptObject
     )
 {
-    PXENBUS_RESOURCE                Interrupt;
     IO_CONNECT_INTERRUPT_PARAMETERS Connect;
-    PKINTERRUPT                     InterruptObject;
     NTSTATUS                        status;
 
-    Interrupt = __FdoGetResource(Fdo, INTERRUPT_RESOURCE);
-
     RtlZeroMemory(&Connect, sizeof (IO_CONNECT_INTERRUPT_PARAMETERS));
     Connect.Version = CONNECT_FULLY_SPECIFIED;
     Connect.FullySpecified.PhysicalDeviceObject = __FdoGetPhysicalDeviceObject(Fdo);
-    Connect.FullySpecified.SynchronizeIrql = (KIRQL)Interrupt->Translated.u.Interrupt.Level;
+    Connect.FullySpecified.SynchronizeIrql = SynchronizeIrql;
     Connect.FullySpecified.ShareVector = (BOOLEAN)(Interrupt->Translated.ShareDisposition == CmResourceShareShared);
     Connect.FullySpecified.Vector = Interrupt->Translated.u.Interrupt.Vector;
     Connect.FullySpecified.Irql = (KIRQL)Interrupt->Translated.u.Interrupt.Level;
@@ -1570,16 +1650,14 @@ FdoConnectInterrupt(
                                            Latched :
                                            LevelSensitive;
     Connect.FullySpecified.ProcessorEnableMask = Interrupt->Translated.u.Interrupt.Affinity;
-    Connect.FullySpecified.InterruptObject = &InterruptObject;
-    Connect.FullySpecified.ServiceRoutine = FdoInterrupt;
-    Connect.FullySpecified.ServiceContext = Fdo;
+    Connect.FullySpecified.InterruptObject = InterruptObject;
+    Connect.FullySpecified.ServiceRoutine = ServiceRoutine;
+    Connect.FullySpecified.ServiceContext = ServiceContext;
 
     status = IoConnectInterruptEx(&Connect);
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    __FdoSetInterruptObject(Fdo, InterruptObject);
-
     return STATUS_SUCCESS;
 
 fail1:
@@ -1589,16 +1667,12 @@ fail1:
 }
 
 static VOID
-FdoDisconnectInterrupt(
-    IN  PXENBUS_FDO                     Fdo
+__FdoDisconnectInterrupt(
+    IN  PKINTERRUPT                     InterruptObject
     )
 {
-    PKINTERRUPT                         InterruptObject;
     IO_DISCONNECT_INTERRUPT_PARAMETERS  Disconnect;
 
-    InterruptObject = __FdoGetInterruptObject(Fdo);
-    __FdoSetInterruptObject(Fdo, NULL);
-
     RtlZeroMemory(&Disconnect, sizeof (IO_DISCONNECT_INTERRUPT_PARAMETERS));
     Disconnect.Version = CONNECT_FULLY_SPECIFIED;
     Disconnect.ConnectionContext.InterruptObject = InterruptObject;
@@ -1606,6 +1680,103 @@ FdoDisconnectInterrupt(
     IoDisconnectInterruptEx(&Disconnect);
 }
 
+static NTSTATUS
+FdoConnectInterrupt(
+    IN  PXENBUS_FDO     Fdo
+    )
+{
+    PXENBUS_RESOURCE    Interrupt;
+    KIRQL               SynchronizeIrql;
+    PKINTERRUPT         InterruptObject;
+    ULONG               Cpu;
+    NTSTATUS            status;
+
+    Interrupt = __FdoGetResource(Fdo, INTERRUPT_RESOURCE);
+
+    // All the interrupts share a synchronization IRQL so that their
+    // spinlocks can be nested
+    SynchronizeIrql = (KIRQL)Interrupt->Translated.u.Interrupt.Level;
+
+    for (Cpu = 0; Cpu < MAXIMUM_PROCESSORS; Cpu++) {
+        PXENBUS_MESSAGE Message = &Fdo->Message[Cpu];
+
+        if (Message->Fdo == NULL)
+            continue;
+
+        SynchronizeIrql = __max(SynchronizeIrql,
+                                (KIRQL)Message->Resource.Translated.u.Interrupt.Level);
+    }
+
+    status = __FdoConnectInterrupt(Fdo,
+                                   Interrupt,
+                                   SynchronizeIrql,
+                                   FdoInterrupt,
+                                   Fdo,
+                                   &InterruptObject);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    __FdoSetInterruptObject(Fdo, InterruptObject);
+
+    // A processor without an upcall interrupt just falls back to the
+    // callback interrupt
+    for (Cpu = 0; Cpu < MAXIMUM_PROCESSORS; Cpu++) {
+        PXENBUS_MESSAGE Message = &Fdo->Message[Cpu];
+
+        if (Message->Fdo == NULL)
+            continue;
+
+        status = __FdoConnectInterrupt(Fdo,
+                                       &Message->Resource,
+                                       SynchronizeIrql,
+                                       FdoUpcall,
+                                       Message,
+                                       &InterruptObject);
+        if (!NT_SUCCESS(status)) {
+            Warning("%s: CPU %u: no upcall interrupt (%08x)\n",
+                    __FdoGetName(Fdo),
+                    Cpu,
+                    status);
+            continue;
+        }
+
+        Message->InterruptObject = InterruptObject;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+FdoDisconnectInterrupt(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    PKINTERRUPT     InterruptObject;
+    ULONG           Cpu;
+
+    for (Cpu = 0; Cpu < MAXIMUM_PROCESSORS; Cpu++) {
+        PXENBUS_MESSAGE Message = &Fdo->Message[Cpu];
+
+        InterruptObject = Message->InterruptObject;
+        if (InterruptObject == NULL)
+            continue;
+
+        Message->InterruptObject = NULL;
+
+        __FdoDisconnectInterrupt(InterruptObject);
+    }
+
+    InterruptObject = __FdoGetInterruptObject(Fdo);
+    __FdoSetInterruptObject(Fdo, NULL);
+
+    __FdoDisconnectInterrupt(InterruptObject);
+}
+
 PXENFILT_UNPLUG_INTERFACE
 FdoGetUnplugInterface(
     IN  PXENBUS_FDO     Fdo
@@ -2351,6 +2522,7 @@ fail3:
 fail2:
     Error("fail2\n");
 
+    RtlZeroMemory(&Fdo->Message, sizeof (XENBUS_MESSAGE) * MAXIMUM_PROCESSORS);
     RtlZeroMemory(&Fdo->Resource, sizeof (XENBUS_RESOURCE) * RESOURCE_COUNT);
 
 fail1:
@@ -2454,6 +2626,7 @@ FdoStopDevice(
     FdoDisconnectInterrupt(Fdo);
 
 done:
+    RtlZeroMemory(&Fdo->Message, sizeof (XENBUS_MESSAGE) * MAXIMUM_PROCESSORS);
     RtlZeroMemory(&Fdo->Resource, sizeof (XENBUS_RESOURCE) * RESOURCE_COUNT);
 
     __FdoSetDevicePnpState(Fdo, Stopped);
@@ -2632,6 +2805,7 @@ FdoRemoveDevice(
     FdoDisconnectInterrupt(Fdo);
 
 done:
+    RtlZeroMemory(&Fdo->Message, sizeof (XENBUS_MESSAGE) * MAXIMUM_PROCESSORS);
     RtlZeroMemory(&Fdo->Resource, sizeof (XENBUS_RESOURCE) * RESOURCE_COUNT);
 
     __FdoSetDevicePnpState(Fdo, Deleted);
@@ -2937,6 +3111,99 @@ done:
     return status;
 }
 
+// Ask for a message interrupt targeted at each processor so that event
+// channel upcalls can be delivered on a per-vCPU vector
+static DECLSPEC_NOINLINE NTSTATUS
+FdoFilterResourceRequirements(
+    IN  PXENBUS_FDO                 Fdo,
+    IN  PIRP                        Irp
+    )
+{
+    PIO_STACK_LOCATION              StackLocation;
+    PIO_RESOURCE_REQUIREMENTS_LIST  Old;
+    PIO_RESOURCE_REQUIREMENTS_LIST  New;
+    PIO_RESOURCE_LIST               List;
+    ULONG                           Count;
+    ULONG                           Size;
+    ULONG                           Cpu;
+    NTSTATUS                        status;
+
+    status = FdoForwardIrpSynchronously(Fdo, Irp);
+    if (!NT_SUCCESS(status) && status != STATUS_NOT_SUPPORTED)
+        goto fail1;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    Old = (NT_SUCCESS(status)) ?
+          (PIO_RESOURCE_REQUIREMENTS_LIST)Irp->IoStatus.Information :
+          StackLocation->Parameters.FilterResourceRequirements.IoResourceRequirementList;
+
+    if (Old == NULL || !__FdoIsActive(Fdo))
+        goto done;
+
+    // The platform device only ever has a single alternative
+    if (Old->AlternativeLists != 1)
+        goto done;
+
+    Count = __min((ULONG)KeNumberProcessors, MAXIMUM_PROCESSORS);
+    Size = Old->ListSize + (sizeof (IO_RESOURCE_DESCRIPTOR) * Count);
+
+    New = ExAllocatePoolWithTag(PagedPool, Size, 'SUB');
+
+    status = STATUS_NO_MEMORY;
+    if (New == NULL)
+        goto fail2;
+
+    RtlCopyMemory(New, Old, Old->ListSize);
+    New->ListSize = Size;
+
+    List = &New->List[0];
+
+    for (Cpu = 0; Cpu < Count; Cpu++) {
+        PIO_RESOURCE_DESCRIPTOR Interrupt;
+
+        Interrupt = &List->Descriptors[List->Count++];
+
+        RtlZeroMemory(Interrupt, sizeof (IO_RESOURCE_DESCRIPTOR));
+        Interrupt->Type = CmResourceTypeInterrupt;
+        Interrupt->ShareDisposition = CmResourceShareDeviceExclusive;
+        Interrupt->Flags = CM_RESOURCE_INTERRUPT_LATCHED |
+                           CM_RESOURCE_INTERRUPT_MESSAGE |
+                           CM_RESOURCE_INTERRUPT_POLICY_INCLUDED;
+
+        Interrupt->u.Interrupt.MinimumVector = CM_RESOURCE_INTERRUPT_MESSAGE_TOKEN;
+        Interrupt->u.Interrupt.MaximumVector = CM_RESOURCE_INTERRUPT_MESSAGE_TOKEN;
+        Interrupt->u.Interrupt.AffinityPolicy = IrqPolicySpecifiedProcessors;
+        Interrupt->u.Interrupt.PriorityPolicy = IrqPriorityUndefined;
+        Interrupt->u.Interrupt.TargetedProcessors = (KAFFINITY)1 << Cpu;
+    }
+
+    Info("%s: added %u upcall interrupt(s)\n", __FdoGetName(Fdo), Count);
+
+    if (Old == (PIO_RESOURCE_REQUIREMENTS_LIST)Irp->IoStatus.Information)
+        ExFreePool(Old);
+
+    Irp->IoStatus.Information = (ULONG_PTR)New;
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+
+done:
+    status = Irp->IoStatus.Status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
 static DECLSPEC_NOINLINE NTSTATUS
 FdoDispatchPnp(
     IN  PXENBUS_FDO     Fdo,
@@ -3003,6 +3270,10 @@ FdoDispatchPnp(
         status = FdoQueryPnpDeviceState(Fdo, Irp);
         break;
 
+    case IRP_MN_FILTER_RESOURCE_REQUIREMENTS:
+        status = FdoFilterResourceRequirements(Fdo, Irp);
+        break;
+
     default:
         IoSkipCurrentIrpStackLocation(Irp);
         status = IoCallDriver(Fdo->LowerDeviceObject, Irp);
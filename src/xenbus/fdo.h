@@ -149,6 +149,13 @@ FdoGetInterruptObject(
     IN  PXENBUS_FDO Fdo
     );
 
+extern PKINTERRUPT
+FdoGetUpcallInterrupt(
+    IN  PXENBUS_FDO Fdo,
+    IN  ULONG       Cpu,
+    OUT PUCHAR      Vector
+    );
+
 extern PXENFILT_UNPLUG_INTERFACE
 FdoGetUnplugInterface(
     IN  PXENBUS_FDO Fdo
@@ -37,42 +37,185 @@
 
 #include "gnttab.h"
 #include "fdo.h"
+#include "driver.h"
+#include "registry.h"
 #include "range_set.h"
+#include "thread.h"
 #include "dbg_print.h"
 #include "assert.h"
 
-#define GNTTAB_MAXIMUM_FRAME_COUNT  32
+// Used if Xen cannot tell us how big the table may grow
+#define GNTTAB_DEFAULT_FRAME_COUNT  32
 #define GNTTAB_ENTRY_PER_FRAME      (PAGE_SIZE / sizeof (grant_entry_v1_t))
 
 // Xen requires that we avoid the first 8 entries of the table and
 // we also reserve extra entries for the crash kernel
 #define GNTTAB_RESERVED_ENTRY_COUNT 32
 
+// Wake the expand thread when fewer than this many references are free
+#define GNTTAB_EXPAND_WATERMARK     (GNTTAB_ENTRY_PER_FRAME / 2)
+
+// Checked builds keep a magic number and a shadow of the grant entry in
+// each descriptor. Free builds only store the reference
+#define GNTTAB_DESCRIPTOR_AUDIT DBG
+
 #define GNTTAB_DESCRIPTOR_MAGIC 'DTNG'
 
+#define TIME_US(_us)        ((_us) * 10)
+#define TIME_MS(_ms)        (TIME_US((_ms) * 1000))
+#define TIME_RELATIVE(_t)   (-(_t))
+
+// Busy grants are retried every GNTTAB_DEFERRED_PERIOD ms and leaked
+// if the backend still has them after GNTTAB_DEFERRED_MAXIMUM_ATTEMPT tries
+#define GNTTAB_DEFERRED_PERIOD          10
+#define GNTTAB_DEFERRED_MAXIMUM_ATTEMPT 1000
+
 #define MAXNAMELEN  128
 
+// Number of segments passed to each GNTTABOP_copy hypercall
+#define GNTTAB_COPY_BATCH_SIZE  16
+
+// Foreign grants are mapped into a window of the platform BAR that is
+// reserved, and mapped into system space, once at initialization
+#define GNTTAB_FOREIGN_PAGE_COUNT   1024
+#define GNTTAB_MAP_BATCH_SIZE       16
+
+typedef struct _XENBUS_GNTTAB_FOREIGN_PAGE {
+    grant_handle_t  Handle;
+    ULONG           Count;  // Set on the first page of each mapping
+} XENBUS_GNTTAB_FOREIGN_PAGE, *PXENBUS_GNTTAB_FOREIGN_PAGE;
+
+// Sampled from the per-CPU counts when the statistics are read, so Peak
+// is the highest number outstanding at any sample rather than at any time
+typedef struct _XENBUS_GNTTAB_STATISTICS {
+    LONG    Outstanding;
+    LONG    Peak;
+    LONG    Grants;
+    LONG    Revokes;
+    LONG    LastGrants;
+    LONG    LastRevokes;
+} XENBUS_GNTTAB_STATISTICS, *PXENBUS_GNTTAB_STATISTICS;
+
+// Backend domains beyond this many are accounted together
+#define GNTTAB_DOMAIN_COUNT 16
+
+typedef struct _XENBUS_GNTTAB_DOMAIN {
+    LONG                        Id;     // domid + 1, zero if unused
+    XENBUS_GNTTAB_STATISTICS    Statistics;
+} XENBUS_GNTTAB_DOMAIN, *PXENBUS_GNTTAB_DOMAIN;
+
+#define GNTTAB_CACHE_LINE_SIZE  64
+
+typedef struct _XENBUS_GNTTAB_COUNT {
+    LONG    Grants;
+    LONG    Revokes;
+} XENBUS_GNTTAB_COUNT, *PXENBUS_GNTTAB_COUNT;
+
+// Counts are kept per CPU, each CPU's on its own cache lines, so that
+// granting and revoking do not contend with other CPUs
+typedef struct _XENBUS_GNTTAB_CACHE_CPU {
+    XENBUS_GNTTAB_COUNT Count;
+    UCHAR               Pad[GNTTAB_CACHE_LINE_SIZE - sizeof (XENBUS_GNTTAB_COUNT)];
+} XENBUS_GNTTAB_CACHE_CPU, *PXENBUS_GNTTAB_CACHE_CPU;
+
+typedef struct _XENBUS_GNTTAB_DOMAIN_CPU {
+    XENBUS_GNTTAB_COUNT Count[GNTTAB_DOMAIN_COUNT + 1]; // The last is for other domains
+    UCHAR               Pad[GNTTAB_CACHE_LINE_SIZE -
+                            ((sizeof (XENBUS_GNTTAB_COUNT) * (GNTTAB_DOMAIN_COUNT + 1)) %
+                             GNTTAB_CACHE_LINE_SIZE)];
+} XENBUS_GNTTAB_DOMAIN_CPU, *PXENBUS_GNTTAB_DOMAIN_CPU;
+
+// Interval at which statistics are written to xenstore, if enabled
+#define GNTTAB_STATISTICS_PERIOD    10000
+
+// Persistent grants are kept per cache and the least recently used one
+// that is no longer referenced is revoked once the limit is reached
+#define GNTTAB_PERSISTENT_HASH_SIZE 64
+#define GNTTAB_PERSISTENT_MAXIMUM   1024
+
 struct _XENBUS_GNTTAB_CACHE {
+    LIST_ENTRY              ListEntry;
     PXENBUS_GNTTAB_CONTEXT  Context;
     CHAR                    Name[MAXNAMELEN];
     VOID                    (*AcquireLock)(PVOID);
     VOID                    (*ReleaseLock)(PVOID);
     PVOID                   Argument;
     PXENBUS_CACHE           Cache;
+    LIST_ENTRY              PersistentHash[GNTTAB_PERSISTENT_HASH_SIZE];
+    LIST_ENTRY              PersistentLru;
+    ULONG                   PersistentCount;
+    LONG                    DeferredCount;
+    XENBUS_GNTTAB_CACHE_CPU     Cpu[MAXIMUM_PROCESSORS];
+    XENBUS_GNTTAB_STATISTICS    Statistics;
 };
 
+// Descriptors are CACHE objects, so each one also carries an
+// OBJECT_HEADER, but they are packed into page-sized slabs rather than
+// each taking its own pool allocation
 struct _XENBUS_GNTTAB_DESCRIPTOR {
-    ULONG               Magic;
     ULONG               Reference;
+#if GNTTAB_DESCRIPTOR_AUDIT
+    ULONG               Magic;
     grant_entry_v1_t    Entry;
+#endif
 };
 
+typedef struct _XENBUS_GNTTAB_PERSISTENT {
+    LIST_ENTRY                  HashEntry;
+    LIST_ENTRY                  LruEntry;
+    USHORT                      Domain;
+    PFN_NUMBER                  Pfn;
+    BOOLEAN                     ReadOnly;
+    ULONG                       References;
+    PXENBUS_GNTTAB_DESCRIPTOR   Descriptor;
+} XENBUS_GNTTAB_PERSISTENT, *PXENBUS_GNTTAB_PERSISTENT;
+
+typedef struct _XENBUS_GNTTAB_DEFERRED {
+    LIST_ENTRY                  ListEntry;
+    PXENBUS_GNTTAB_CACHE        Cache;
+    PXENBUS_GNTTAB_DESCRIPTOR   Descriptor;
+    VOID                        (*Callback)(PVOID, NTSTATUS);
+    PVOID                       Argument;
+    ULONG                       Attempt;
+    NTSTATUS                    Status;
+} XENBUS_GNTTAB_DEFERRED, *PXENBUS_GNTTAB_DEFERRED;
+
 struct _XENBUS_GNTTAB_CONTEXT {
     LONG                        References;
     PFN_NUMBER                  Pfn;
     LONG                        FrameIndex;
+    LONG                        MaximumFrameCount;
+    PULONG_PTR                  MapIndex;
+    PPFN_NUMBER                 MapPfn;
+    PLONG                       MapError;
     grant_entry_v1_t            *Entry;
+    PFN_NUMBER                  ForeignPfn;
+    ULONG                       ForeignPageCount;
+    PUCHAR                      ForeignAddress;
+    PXENBUS_GNTTAB_FOREIGN_PAGE ForeignPage;
+    PXENBUS_RANGE_SET           ForeignRangeSet;
     PXENBUS_RANGE_SET           RangeSet;
+    KSPIN_LOCK                  ExpandLock;
+    PXENBUS_THREAD              ExpandThread;
+    ULONG                       ExpandCount;
+    BOOLEAN                     Full;
+    KSPIN_LOCK                  DeferredLock;
+    LIST_ENTRY                  DeferredList;
+    KTIMER                      DeferredTimer;
+    KDPC                        DeferredDpc;
+    ULONG                       DeferredCount;
+    ULONG                       RetryCount;
+    ULONG                       LeakCount;
+    LONG                        PersistentHitCount;
+    LONG                        PersistentMissCount;
+    LONG                        PersistentOverflowCount;
+    KSPIN_LOCK                  CacheLock;
+    LIST_ENTRY                  CacheList;
+    XENBUS_GNTTAB_DOMAIN        Domain[GNTTAB_DOMAIN_COUNT];
+    XENBUS_GNTTAB_STATISTICS    OtherDomains;
+    XENBUS_GNTTAB_DOMAIN_CPU    DomainCpu[MAXIMUM_PROCESSORS];
+    ULONGLONG                   StatisticsTime;
+    PXENBUS_STORE_INTERFACE     StoreInterface;
     PXENBUS_CACHE_INTERFACE     CacheInterface;
     PXENBUS_SUSPEND_INTERFACE   SuspendInterface;
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackEarly;
@@ -98,6 +241,168 @@ __GnttabFree(
     __FreePoolWithTag(Buffer, GNTTAB_TAG);
 }
 
+// Returns the index of the domain's counts, GNTTAB_DOMAIN_COUNT if it
+// has to be accounted with the other domains
+static ULONG
+__GnttabGetDomainIndex(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  USHORT                  Domain
+    )
+{
+    LONG                        Id = (LONG)Domain + 1;
+    ULONG                       Index;
+
+    for (Index = 0; Index < GNTTAB_DOMAIN_COUNT; Index++) {
+        PXENBUS_GNTTAB_DOMAIN   Slot = &Context->Domain[Index];
+
+        if (Slot->Id == Id)
+            return Index;
+
+        if (Slot->Id == 0 &&
+            (InterlockedCompareExchange(&Slot->Id, Id, 0) == 0 ||
+             Slot->Id == Id))
+            return Index;
+    }
+
+    return GNTTAB_DOMAIN_COUNT;
+}
+
+// The counts belong to the current CPU so the interlocked adds do not
+// contend; they are only needed in case the thread has since migrated
+static FORCEINLINE VOID
+__GnttabAccountGrant(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  USHORT                  Domain,
+    IN  LONG                    Count
+    )
+{
+    ULONG                       Index = __GnttabGetDomainIndex(Context, Domain);
+    ULONG                       Cpu = KeGetCurrentProcessorNumber();
+
+    ASSERT3U(Cpu, <, MAXIMUM_PROCESSORS);
+
+    InterlockedExchangeAdd(&Cache->Cpu[Cpu].Count.Grants, Count);
+    InterlockedExchangeAdd(&Context->DomainCpu[Cpu].Count[Index].Grants, Count);
+}
+
+static FORCEINLINE VOID
+__GnttabAccountRevoke(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  USHORT                  Domain,
+    IN  LONG                    Count
+    )
+{
+    ULONG                       Index = __GnttabGetDomainIndex(Context, Domain);
+    ULONG                       Cpu = KeGetCurrentProcessorNumber();
+
+    ASSERT3U(Cpu, <, MAXIMUM_PROCESSORS);
+
+    InterlockedExchangeAdd(&Cache->Cpu[Cpu].Count.Revokes, Count);
+    InterlockedExchangeAdd(&Context->DomainCpu[Cpu].Count[Index].Revokes, Count);
+}
+
+static VOID
+__GnttabSampleStatistics(
+    IN  PXENBUS_GNTTAB_STATISTICS   Statistics,
+    IN  ULONG                       Grants,
+    IN  ULONG                       Revokes
+    )
+{
+    Statistics->Grants = (LONG)Grants;
+    Statistics->Revokes = (LONG)Revokes;
+    Statistics->Outstanding = (LONG)(Grants - Revokes);
+
+    if (Statistics->Outstanding > Statistics->Peak)
+        Statistics->Peak = Statistics->Outstanding;
+}
+
+static VOID
+__GnttabSampleCache(
+    IN  PXENBUS_GNTTAB_CACHE    Cache
+    )
+{
+    ULONG                       Grants;
+    ULONG                       Revokes;
+    ULONG                       Cpu;
+
+    Grants = 0;
+    Revokes = 0;
+
+    for (Cpu = 0; Cpu < MAXIMUM_PROCESSORS; Cpu++) {
+        Grants += (ULONG)Cache->Cpu[Cpu].Count.Grants;
+        Revokes += (ULONG)Cache->Cpu[Cpu].Count.Revokes;
+    }
+
+    __GnttabSampleStatistics(&Cache->Statistics, Grants, Revokes);
+}
+
+static VOID
+__GnttabSampleDomains(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context
+    )
+{
+    ULONG                       Index;
+
+    for (Index = 0; Index <= GNTTAB_DOMAIN_COUNT; Index++) {
+        ULONG                   Grants;
+        ULONG                   Revokes;
+        ULONG                   Cpu;
+
+        Grants = 0;
+        Revokes = 0;
+
+        for (Cpu = 0; Cpu < MAXIMUM_PROCESSORS; Cpu++) {
+            Grants += (ULONG)Context->DomainCpu[Cpu].Count[Index].Grants;
+            Revokes += (ULONG)Context->DomainCpu[Cpu].Count[Index].Revokes;
+        }
+
+        __GnttabSampleStatistics((Index < GNTTAB_DOMAIN_COUNT) ?
+                                 &Context->Domain[Index].Statistics :
+                                 &Context->OtherDomains,
+                                 Grants,
+                                 Revokes);
+    }
+}
+
+static VOID
+__GnttabPublishStatistics(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context
+    )
+{
+    ULONG                       Index;
+
+    __GnttabSampleDomains(Context);
+
+    for (Index = 0; Index < GNTTAB_DOMAIN_COUNT; Index++) {
+        PXENBUS_GNTTAB_DOMAIN   Slot = &Context->Domain[Index];
+        CHAR                    Node[sizeof ("65535")];
+        NTSTATUS                status;
+
+        if (Slot->Id == 0)
+            break;
+
+        status = RtlStringCbPrintfA(Node,
+                                    sizeof (Node),
+                                    "%u",
+                                    Slot->Id - 1);
+        ASSERT(NT_SUCCESS(status));
+
+        (VOID) STORE(Printf,
+                     Context->StoreInterface,
+                     NULL,
+                     "data/gnttab",
+                     Node,
+                     "%d %d %u %u",
+                     Slot->Statistics.Outstanding,
+                     Slot->Statistics.Peak,
+                     Slot->Statistics.Grants,
+                     Slot->Statistics.Revokes);
+    }
+}
+
+// Must be called with ExpandLock held
 static FORCEINLINE NTSTATUS
 __GnttabExpand(
     IN  PXENBUS_GNTTAB_CONTEXT  Context
@@ -109,11 +414,11 @@ __GnttabExpand(
     LONGLONG                    End;
     NTSTATUS                    status;
 
-    FrameIndex = InterlockedIncrement(&Context->FrameIndex);
+    FrameIndex = Context->FrameIndex + 1;
 
     status = STATUS_INSUFFICIENT_RESOURCES;
-    ASSERT3U(FrameIndex, <=, GNTTAB_MAXIMUM_FRAME_COUNT);
-    if (FrameIndex == GNTTAB_MAXIMUM_FRAME_COUNT)
+    ASSERT3U(FrameIndex, <=, Context->MaximumFrameCount);
+    if (FrameIndex == Context->MaximumFrameCount)
         goto fail1;
 
     Pfn = Context->Pfn + FrameIndex;
@@ -123,6 +428,16 @@ __GnttabExpand(
                                 FrameIndex);
     ASSERT(NT_SUCCESS(status));
 
+    Context->FrameIndex = FrameIndex;
+    Context->ExpandCount++;
+
+    // Latched so that nothing keeps trying to expand once the table
+    // has reached its maximum size
+    if (FrameIndex + 1 == Context->MaximumFrameCount) {
+        Info("grant table full (%d frames)\n", Context->MaximumFrameCount);
+        Context->Full = TRUE;
+    }
+
     Start = __max(GNTTAB_RESERVED_ENTRY_COUNT, FrameIndex * GNTTAB_ENTRY_PER_FRAME);
     End = ((FrameIndex + 1) * GNTTAB_ENTRY_PER_FRAME) - 1;
 
@@ -138,23 +453,88 @@ fail1:
     return status;
 }
 
+static NTSTATUS
+GnttabExpand(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               _Context
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT  Context = _Context;
+    PKEVENT                 Event;
+    ULONGLONG               Due;
+
+    Trace("====>\n");
+
+    Event = ThreadGetEvent(Self);
+
+    Due = KeQueryInterruptTime() + TIME_MS(GNTTAB_STATISTICS_PERIOD);
+
+    for (;;) {
+        LARGE_INTEGER   Timeout;
+        ULONGLONG       Now;
+        KIRQL           Irql;
+        NTSTATUS        status;
+
+        // This thread also publishes statistics, if that is enabled.
+        // The deadline is absolute so that being woken to expand does
+        // not put publication off.
+        Now = KeQueryInterruptTime();
+        Timeout.QuadPart = (Due > Now) ? TIME_RELATIVE((LONGLONG)(Due - Now)) : 0;
+
+        status = KeWaitForSingleObject(Event,
+                                       Executive,
+                                       KernelMode,
+                                       FALSE,
+                                       (Context->StoreInterface != NULL) ?
+                                       &Timeout :
+                                       NULL);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        if (Context->StoreInterface != NULL &&
+            KeQueryInterruptTime() >= Due) {
+            __GnttabPublishStatistics(Context);
+            Due = KeQueryInterruptTime() + TIME_MS(GNTTAB_STATISTICS_PERIOD);
+        }
+
+        if (status == STATUS_TIMEOUT)
+            continue;
+
+        KeAcquireSpinLock(&Context->ExpandLock, &Irql);
+
+        while (!Context->Full &&
+               RangeSetCount(Context->RangeSet) < GNTTAB_EXPAND_WATERMARK) {
+            status = __GnttabExpand(Context);
+            if (!NT_SUCCESS(status))
+                break;
+        }
+
+        KeReleaseSpinLock(&Context->ExpandLock, Irql);
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
 static FORCEINLINE VOID
 __GnttabShrink(
     IN  PXENBUS_GNTTAB_CONTEXT  Context
     )
 {
-    LONGLONG                    Entry;
-
-    for (Entry = GNTTAB_RESERVED_ENTRY_COUNT;
-         Entry < (LONGLONG)((Context->FrameIndex + 1) * GNTTAB_ENTRY_PER_FRAME);
-         Entry++) {
-        NTSTATUS    status;
+    NTSTATUS                    status;
 
-        status = RangeSetGet(Context->RangeSet, Entry);
+    if (Context->FrameIndex >= 0) {
+        status = RangeSetGetRange(Context->RangeSet,
+                                  GNTTAB_RESERVED_ENTRY_COUNT,
+                                  ((Context->FrameIndex + 1) * GNTTAB_ENTRY_PER_FRAME) - 1);
         ASSERT(NT_SUCCESS(status));
     }
 
     Context->FrameIndex = -1;
+    Context->Full = FALSE;
 }
 
 static NTSTATUS
@@ -167,12 +547,28 @@ GnttabDescriptorCtor(
     PXENBUS_GNTTAB_CONTEXT      Context = Cache->Context;
     PXENBUS_GNTTAB_DESCRIPTOR   Descriptor = Object;
     LONGLONG                    Reference;
+    KIRQL                       Irql;
     NTSTATUS                    status;
 
+    if (!Context->Full &&
+        RangeSetCount(Context->RangeSet) < GNTTAB_EXPAND_WATERMARK)
+        ThreadWake(Context->ExpandThread);
+
     if (!RangeSetIsEmpty(Context->RangeSet))
         goto done;
 
-    status = __GnttabExpand(Context);
+    // The expand thread has not kept up so we have to do it here
+    KeAcquireSpinLock(&Context->ExpandLock, &Irql);
+
+    if (!RangeSetIsEmpty(Context->RangeSet))
+        status = STATUS_SUCCESS;
+    else if (Context->Full)
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    else
+        status = __GnttabExpand(Context);
+
+    KeReleaseSpinLock(&Context->ExpandLock, Irql);
+
     if (!NT_SUCCESS(status))
         goto fail1;
 
@@ -181,7 +577,9 @@ done:
     if (!NT_SUCCESS(status))
         goto fail2;
 
+#if GNTTAB_DESCRIPTOR_AUDIT
     Descriptor->Magic = GNTTAB_DESCRIPTOR_MAGIC;
+#endif
     Descriptor->Reference = (ULONG)Reference;
 
     return STATUS_SUCCESS;
@@ -232,6 +630,275 @@ GnttabReleaseLock(
     Cache->ReleaseLock(Cache->Argument);
 }
 
+static FORCEINLINE VOID
+__GnttabAuditDescriptor(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor
+    )
+{
+    ASSERT3U(Descriptor->Reference, >=, GNTTAB_RESERVED_ENTRY_COUNT);
+    ASSERT3U(Descriptor->Reference, <, (Context->FrameIndex + 1) * GNTTAB_ENTRY_PER_FRAME);
+
+#if GNTTAB_DESCRIPTOR_AUDIT
+    {
+        grant_entry_v1_t    *Entry = &Context->Entry[Descriptor->Reference];
+
+        ASSERT3U(Descriptor->Magic, ==, GNTTAB_DESCRIPTOR_MAGIC);
+        ASSERT3U(Descriptor->Entry.domid, ==, Entry->domid);
+        ASSERT3U(Descriptor->Entry.frame, ==, Entry->frame);
+    }
+#endif
+}
+
+// The grant entry is written directly. GTF_permit_access is set later
+static FORCEINLINE VOID
+__GnttabFillEntry(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor,
+    IN  USHORT                      Domain,
+    IN  PFN_NUMBER                  Pfn,
+    IN  BOOLEAN                     ReadOnly
+    )
+{
+    grant_entry_v1_t                *Entry;
+
+    Entry = &Context->Entry[Descriptor->Reference];
+
+    Entry->flags = (ReadOnly) ? GTF_readonly : 0;
+    Entry->domid = Domain;
+
+    Entry->frame = (uint32_t)Pfn;
+    ASSERT3U(Entry->frame, ==, Pfn);
+
+#if GNTTAB_DESCRIPTOR_AUDIT
+    Descriptor->Entry = *Entry;
+#endif
+}
+
+// Clears the grant entry, without accounting for it, and returns the
+// domain it was granted to
+static BOOLEAN
+__GnttabTryClearEntry(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor,
+    OUT PUSHORT                     Domain
+    )
+{
+    grant_entry_v1_t                *Entry;
+    volatile SHORT                  *Flags;
+    uint16_t                        Old;
+    uint16_t                        New;
+
+    __GnttabAuditDescriptor(Context, Descriptor);
+
+    Entry = &Context->Entry[Descriptor->Reference];
+    Flags = (volatile SHORT *)&Entry->flags;
+
+    Old = *Flags;
+    Old &= ~(GTF_reading | GTF_writing);
+
+    New = Old & ~GTF_permit_access;
+
+    if (InterlockedCompareExchange16(Flags, New, Old) != Old)
+        return FALSE;
+
+    *Domain = Entry->domid;
+
+    RtlZeroMemory(Entry, sizeof (grant_entry_v1_t));
+#if GNTTAB_DESCRIPTOR_AUDIT
+    RtlZeroMemory(&Descriptor->Entry, sizeof (grant_entry_v1_t));
+#endif
+
+    return TRUE;
+}
+
+static NTSTATUS
+__GnttabClearEntry(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor,
+    OUT PUSHORT                     Domain
+    )
+{
+    ULONG                           Attempt;
+    NTSTATUS                        status;
+
+    Attempt = 0;
+    while (!__GnttabTryClearEntry(Context, Descriptor, Domain)) {
+        status = STATUS_UNSUCCESSFUL;
+        if (++Attempt == 100)
+            goto fail1;
+
+        SchedYield();
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static BOOLEAN
+__GnttabTryRevokeEntry(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor
+    )
+{
+    USHORT                          Domain;
+
+    if (!__GnttabTryClearEntry(Context, Descriptor, &Domain))
+        return FALSE;
+
+    __GnttabAccountRevoke(Context, Cache, Domain, 1);
+
+    return TRUE;
+}
+
+static NTSTATUS
+__GnttabRevokeEntry(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor
+    )
+{
+    USHORT                          Domain;
+    NTSTATUS                        status;
+
+    status = __GnttabClearEntry(Context, Descriptor, &Domain);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    __GnttabAccountRevoke(Context, Cache, Domain, 1);
+
+    return STATUS_SUCCESS;
+}
+
+static FORCEINLINE ULONG
+__GnttabPersistentHash(
+    IN  USHORT                  Domain,
+    IN  PFN_NUMBER              Pfn
+    )
+{
+    return (ULONG)((Pfn ^ Domain) % GNTTAB_PERSISTENT_HASH_SIZE);
+}
+
+// Must be called with the cache lock held
+static PXENBUS_GNTTAB_PERSISTENT
+__GnttabLookupPersistent(
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  USHORT                  Domain,
+    IN  PFN_NUMBER              Pfn,
+    IN  BOOLEAN                 ReadOnly
+    )
+{
+    PLIST_ENTRY                 Bucket;
+    PLIST_ENTRY                 ListEntry;
+
+    Bucket = &Cache->PersistentHash[__GnttabPersistentHash(Domain, Pfn)];
+
+    for (ListEntry = Bucket->Flink;
+         ListEntry != Bucket;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_GNTTAB_PERSISTENT   Persistent;
+
+        Persistent = CONTAINING_RECORD(ListEntry, XENBUS_GNTTAB_PERSISTENT, HashEntry);
+
+        if (Persistent->Domain == Domain &&
+            Persistent->Pfn == Pfn &&
+            Persistent->ReadOnly == ReadOnly)
+            return Persistent;
+    }
+
+    return NULL;
+}
+
+// Must be called with the cache lock held
+static BOOLEAN
+__GnttabEvictPersistent(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache
+    )
+{
+    PLIST_ENTRY                     ListEntry;
+
+    for (ListEntry = Cache->PersistentLru.Blink;
+         ListEntry != &Cache->PersistentLru;
+         ListEntry = ListEntry->Blink) {
+        PXENBUS_GNTTAB_PERSISTENT   Persistent;
+
+        Persistent = CONTAINING_RECORD(ListEntry, XENBUS_GNTTAB_PERSISTENT, LruEntry);
+
+        if (Persistent->References != 0)
+            continue;
+
+        // Skip anything the backend still has mapped
+        if (!__GnttabTryRevokeEntry(Context, Cache, Persistent->Descriptor))
+            continue;
+
+        RemoveEntryList(&Persistent->LruEntry);
+        RemoveEntryList(&Persistent->HashEntry);
+
+        ASSERT(Cache->PersistentCount != 0);
+        --Cache->PersistentCount;
+
+        CACHE(Put,
+              Context->CacheInterface,
+              Cache->Cache,
+              Persistent->Descriptor,
+              TRUE);
+
+        __GnttabFree(Persistent);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static VOID
+__GnttabFlushPersistent(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache
+    )
+{
+    Cache->AcquireLock(Cache->Argument);
+
+    while (!IsListEmpty(&Cache->PersistentLru)) {
+        PLIST_ENTRY                 ListEntry;
+        PXENBUS_GNTTAB_PERSISTENT   Persistent;
+        NTSTATUS                    status;
+
+        ListEntry = RemoveHeadList(&Cache->PersistentLru);
+        Persistent = CONTAINING_RECORD(ListEntry, XENBUS_GNTTAB_PERSISTENT, LruEntry);
+
+        RemoveEntryList(&Persistent->HashEntry);
+
+        ASSERT(Cache->PersistentCount != 0);
+        --Cache->PersistentCount;
+
+        ASSERT3U(Persistent->References, ==, 0);
+
+        status = __GnttabRevokeEntry(Context, Cache, Persistent->Descriptor);
+        if (NT_SUCCESS(status))
+            CACHE(Put,
+                  Context->CacheInterface,
+                  Cache->Cache,
+                  Persistent->Descriptor,
+                  TRUE);
+        else
+            Error("%s: leaking reference %08x\n",
+                  Cache->Name,
+                  Persistent->Descriptor->Reference);
+
+        __GnttabFree(Persistent);
+    }
+
+    ASSERT3U(Cache->PersistentCount, ==, 0);
+
+    Cache->ReleaseLock(Cache->Argument);
+}
+
 static NTSTATUS
 GnttabCreateCache(
     IN  PXENBUS_GNTTAB_CONTEXT  Context,
@@ -243,6 +910,8 @@ GnttabCreateCache(
     OUT PXENBUS_GNTTAB_CACHE    *Cache
     )
 {
+    ULONG                       Index;
+    KIRQL                       Irql;
     NTSTATUS                    status;
 
     *Cache = __GnttabAllocate(sizeof (XENBUS_GNTTAB_CACHE));
@@ -264,6 +933,11 @@ GnttabCreateCache(
     (*Cache)->ReleaseLock = ReleaseLock;
     (*Cache)->Argument = Argument;
 
+    for (Index = 0; Index < GNTTAB_PERSISTENT_HASH_SIZE; Index++)
+        InitializeListHead(&(*Cache)->PersistentHash[Index]);
+
+    InitializeListHead(&(*Cache)->PersistentLru);
+
     status = CACHE(Create,
                    Context->CacheInterface,
                    (*Cache)->Name,
@@ -278,11 +952,18 @@ GnttabCreateCache(
     if (!NT_SUCCESS(status))
         goto fail3;
 
+    KeAcquireSpinLock(&Context->CacheLock, &Irql);
+    InsertTailList(&Context->CacheList, &(*Cache)->ListEntry);
+    KeReleaseSpinLock(&Context->CacheLock, Irql);
+
     return STATUS_SUCCESS;
 
 fail3:
     Error("fail3\n");
 
+    RtlZeroMemory(&(*Cache)->PersistentLru, sizeof (LIST_ENTRY));
+    RtlZeroMemory((*Cache)->PersistentHash, sizeof ((*Cache)->PersistentHash));
+
     (*Cache)->Argument = NULL;
     (*Cache)->ReleaseLock = NULL;
     (*Cache)->AcquireLock = NULL;
@@ -309,17 +990,52 @@ GnttabDestroyCache(
     IN  PXENBUS_GNTTAB_CACHE    Cache
     )
 {
-    CACHE(Destroy,
-          Context->CacheInterface,
-          Cache->Cache);
-    Cache->Cache = NULL;
+    KIRQL                       Irql;
 
-    Cache->Argument = NULL;
-    Cache->ReleaseLock = NULL;
-    Cache->AcquireLock = NULL;
+    KeAcquireSpinLock(&Context->CacheLock, &Irql);
+    RemoveEntryList(&Cache->ListEntry);
+    KeReleaseSpinLock(&Context->CacheLock, Irql);
 
-    RtlZeroMemory(Cache->Name, sizeof (Cache->Name));
-    
+    RtlZeroMemory(&Cache->ListEntry, sizeof (LIST_ENTRY));
+
+    // Parked revocations refer to the cache so wait for the DPC to
+    // complete them. This is bounded by GNTTAB_DEFERRED_MAXIMUM_ATTEMPT.
+    while (Cache->DeferredCount != 0) {
+        LARGE_INTEGER   Timeout;
+
+        ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+        Timeout.QuadPart = TIME_RELATIVE(TIME_MS(GNTTAB_DEFERRED_PERIOD));
+
+        (VOID) KeDelayExecutionThread(KernelMode, FALSE, &Timeout);
+    }
+
+    __GnttabFlushPersistent(Context, Cache);
+
+    __GnttabSampleCache(Cache);
+
+    if (Cache->Statistics.Outstanding != 0)
+        Warning("%s: %d grants outstanding\n",
+                Cache->Name,
+                Cache->Statistics.Outstanding);
+
+    RtlZeroMemory(&Cache->Statistics, sizeof (XENBUS_GNTTAB_STATISTICS));
+    RtlZeroMemory(Cache->Cpu, sizeof (Cache->Cpu));
+
+    RtlZeroMemory(&Cache->PersistentLru, sizeof (LIST_ENTRY));
+    RtlZeroMemory(Cache->PersistentHash, sizeof (Cache->PersistentHash));
+
+    CACHE(Destroy,
+          Context->CacheInterface,
+          Cache->Cache);
+    Cache->Cache = NULL;
+
+    Cache->Argument = NULL;
+    Cache->ReleaseLock = NULL;
+    Cache->AcquireLock = NULL;
+
+    RtlZeroMemory(Cache->Name, sizeof (Cache->Name));
+    
     Cache->Context = NULL;
 
     ASSERT(IsZeroMemory(Cache, sizeof (XENBUS_GNTTAB_CACHE)));
@@ -345,26 +1061,816 @@ GnttabPermitForeignAccess(
                         Cache->Cache,
                         Locked);
 
-    status = STATUS_INSUFFICIENT_RESOURCES;
-    if (*Descriptor == NULL)
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (*Descriptor == NULL)
+        goto fail1;
+
+    __GnttabFillEntry(Context, *Descriptor, Domain, Pfn, ReadOnly);
+    KeMemoryBarrier();
+
+    Entry = &Context->Entry[(*Descriptor)->Reference];
+
+    Entry->flags |= GTF_permit_access;
+    KeMemoryBarrier();
+
+    __GnttabAccountGrant(Context, Cache, Domain, 1);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+GnttabRevokeForeignAccess(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor
+    )
+{
+    NTSTATUS                        status;
+
+    status = __GnttabRevokeEntry(Context, Cache, Descriptor);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    CACHE(Put,
+          Context->CacheInterface,
+          Cache->Cache,
+          Descriptor,
+          Locked);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+__GnttabPutMany(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor[],
+    IN  ULONG                       Count
+    )
+{
+    ULONG                           Index;
+
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    for (Index = 0; Index < Count; Index++) {
+        CACHE(Put,
+              Context->CacheInterface,
+              Cache->Cache,
+              Descriptor[Index],
+              TRUE);
+        Descriptor[Index] = NULL;
+    }
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+}
+
+static NTSTATUS
+GnttabPermitForeignAccessMany(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  USHORT                      Domain,
+    IN  PFN_NUMBER                  Pfn[],
+    IN  BOOLEAN                     ReadOnly,
+    IN  ULONG                       Count,
+    OUT PXENBUS_GNTTAB_DESCRIPTOR   Descriptor[]
+    )
+{
+    ULONG                           Index;
+    NTSTATUS                        status;
+
+    // Take the cache lock once for the whole batch
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    for (Index = 0; Index < Count; Index++) {
+        Descriptor[Index] = CACHE(Get,
+                                  Context->CacheInterface,
+                                  Cache->Cache,
+                                  TRUE);
+        if (Descriptor[Index] == NULL)
+            break;
+    }
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (Index < Count)
+        goto fail1;
+
+    for (Index = 0; Index < Count; Index++) {
+        __GnttabFillEntry(Context,
+                          Descriptor[Index],
+                          Domain,
+                          Pfn[Index],
+                          ReadOnly);
+    }
+
+    KeMemoryBarrier();
+
+    for (Index = 0; Index < Count; Index++)
+        Context->Entry[Descriptor[Index]->Reference].flags |= GTF_permit_access;
+
+    KeMemoryBarrier();
+
+    __GnttabAccountGrant(Context, Cache, Domain, (LONG)Count);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    __GnttabPutMany(Context, Cache, Locked, Descriptor, Index);
+
+    return status;
+}
+
+// If a grant is still in use then it and all the grants after it are
+// left in place, still owned by the caller
+static NTSTATUS
+GnttabRevokeForeignAccessMany(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor[],
+    IN  ULONG                       Count
+    )
+{
+    ULONG                           Index;
+    ULONG                           Start;
+    USHORT                          Domain;
+    NTSTATUS                        status;
+
+    Start = 0;
+    Domain = 0;
+    status = STATUS_SUCCESS;
+
+    for (Index = 0; Index < Count; Index++) {
+        USHORT  EntryDomain;
+
+        status = __GnttabClearEntry(Context, Descriptor[Index], &EntryDomain);
+        if (!NT_SUCCESS(status))
+            break;
+
+        // Account each run of grants to the same domain at once
+        if (Index != Start && EntryDomain != Domain) {
+            __GnttabAccountRevoke(Context, Cache, Domain, (LONG)(Index - Start));
+            Start = Index;
+        }
+
+        Domain = EntryDomain;
+    }
+
+    if (Index != Start)
+        __GnttabAccountRevoke(Context, Cache, Domain, (LONG)(Index - Start));
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    __GnttabPutMany(Context, Cache, Locked, Descriptor, Count);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    __GnttabPutMany(Context, Cache, Locked, Descriptor, Index);
+
+    return status;
+}
+
+KDEFERRED_ROUTINE   GnttabDeferredDpc;
+
+VOID
+GnttabDeferredDpc(
+    IN  PKDPC                   Dpc,
+    IN  PVOID                   _Context,
+    IN  PVOID                   Argument1,
+    IN  PVOID                   Argument2
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT      Context = _Context;
+    LIST_ENTRY                  List;
+    PLIST_ENTRY                 ListEntry;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Context != NULL);
+
+    InitializeListHead(&List);
+
+    KeAcquireSpinLockAtDpcLevel(&Context->DeferredLock);
+
+    ListEntry = Context->DeferredList.Flink;
+    while (ListEntry != &Context->DeferredList) {
+        PLIST_ENTRY             Next = ListEntry->Flink;
+        PXENBUS_GNTTAB_DEFERRED Deferred;
+
+        Deferred = CONTAINING_RECORD(ListEntry, XENBUS_GNTTAB_DEFERRED, ListEntry);
+
+        Context->RetryCount++;
+
+        if (__GnttabTryRevokeEntry(Context, Deferred->Cache, Deferred->Descriptor)) {
+            Deferred->Status = STATUS_SUCCESS;
+        } else if (++Deferred->Attempt == GNTTAB_DEFERRED_MAXIMUM_ATTEMPT) {
+            Deferred->Status = STATUS_UNSUCCESSFUL;
+            Context->LeakCount++;
+        } else {
+            ListEntry = Next;
+            continue;
+        }
+
+        RemoveEntryList(ListEntry);
+        InsertTailList(&List, ListEntry);
+
+        ListEntry = Next;
+    }
+
+    if (!IsListEmpty(&Context->DeferredList)) {
+        LARGE_INTEGER   Timeout;
+
+        Timeout.QuadPart = TIME_RELATIVE(TIME_MS(GNTTAB_DEFERRED_PERIOD));
+
+        KeSetTimer(&Context->DeferredTimer,
+                   Timeout,
+                   &Context->DeferredDpc);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Context->DeferredLock);
+
+    // Complete outside the lock as callers may issue more revocations
+    while (!IsListEmpty(&List)) {
+        PXENBUS_GNTTAB_DEFERRED Deferred;
+        PXENBUS_GNTTAB_CACHE    Cache;
+
+        ListEntry = RemoveHeadList(&List);
+        Deferred = CONTAINING_RECORD(ListEntry, XENBUS_GNTTAB_DEFERRED, ListEntry);
+        Cache = Deferred->Cache;
+
+        if (NT_SUCCESS(Deferred->Status)) {
+            CACHE(Put,
+                  Context->CacheInterface,
+                  Cache->Cache,
+                  Deferred->Descriptor,
+                  FALSE);
+        } else {
+            Error("%s: leaking reference %08x\n",
+                  Cache->Name,
+                  Deferred->Descriptor->Reference);
+        }
+
+        if (Deferred->Callback != NULL)
+            Deferred->Callback(Deferred->Argument, Deferred->Status);
+
+        __GnttabFree(Deferred);
+
+        // The cache may be destroyed as soon as this drops to zero
+        (VOID) InterlockedDecrement(&Cache->DeferredCount);
+    }
+}
+
+// Returns STATUS_PENDING if the grant is still in use. The caller must
+// then keep the granted page until Callback is invoked: with
+// STATUS_SUCCESS once the grant has been revoked and the descriptor
+// returned to the cache, or with an error if the grant had to be leaked.
+// DestroyCache waits for any revocations still parked on the cache.
+static NTSTATUS
+GnttabRevokeForeignAccessDeferred(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor,
+    IN  VOID                        (*Callback)(PVOID, NTSTATUS),
+    IN  PVOID                       Argument
+    )
+{
+    PXENBUS_GNTTAB_DEFERRED         Deferred;
+    KIRQL                           Irql;
+    NTSTATUS                        status;
+
+    if (__GnttabTryRevokeEntry(Context, Cache, Descriptor)) {
+        CACHE(Put,
+              Context->CacheInterface,
+              Cache->Cache,
+              Descriptor,
+              Locked);
+
+        return STATUS_SUCCESS;
+    }
+
+    Deferred = __GnttabAllocate(sizeof (XENBUS_GNTTAB_DEFERRED));
+
+    status = STATUS_NO_MEMORY;
+    if (Deferred == NULL)
+        goto fail1;
+
+    Deferred->Cache = Cache;
+    Deferred->Descriptor = Descriptor;
+    Deferred->Callback = Callback;
+    Deferred->Argument = Argument;
+
+    KeAcquireSpinLock(&Context->DeferredLock, &Irql);
+
+    // The timer is only armed while the list is not empty
+    if (IsListEmpty(&Context->DeferredList)) {
+        LARGE_INTEGER   Timeout;
+
+        Timeout.QuadPart = TIME_RELATIVE(TIME_MS(GNTTAB_DEFERRED_PERIOD));
+
+        KeSetTimer(&Context->DeferredTimer,
+                   Timeout,
+                   &Context->DeferredDpc);
+    }
+
+    InsertTailList(&Context->DeferredList, &Deferred->ListEntry);
+    Context->DeferredCount++;
+
+    (VOID) InterlockedIncrement(&Cache->DeferredCount);
+
+    KeReleaseSpinLock(&Context->DeferredLock, Irql);
+
+    return STATUS_PENDING;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Re-granting a page that is already persistently granted to the same
+// domain just takes another reference on the existing grant. If the
+// cache is at its limit and nothing can be evicted then this fails and
+// the caller should use an ordinary grant instead.
+static NTSTATUS
+GnttabPermitForeignAccessPersistent(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  USHORT                      Domain,
+    IN  PFN_NUMBER                  Pfn,
+    IN  BOOLEAN                     ReadOnly,
+    OUT PXENBUS_GNTTAB_DESCRIPTOR   *Descriptor
+    )
+{
+    PXENBUS_GNTTAB_PERSISTENT       Persistent;
+    NTSTATUS                        status;
+
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    Persistent = __GnttabLookupPersistent(Cache, Domain, Pfn, ReadOnly);
+    if (Persistent != NULL) {
+        InterlockedIncrement(&Context->PersistentHitCount);
+
+        RemoveEntryList(&Persistent->LruEntry);
+        goto done;
+    }
+
+    InterlockedIncrement(&Context->PersistentMissCount);
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (Cache->PersistentCount >= GNTTAB_PERSISTENT_MAXIMUM &&
+        !__GnttabEvictPersistent(Context, Cache)) {
+        InterlockedIncrement(&Context->PersistentOverflowCount);
+        goto fail1;
+    }
+
+    Persistent = __GnttabAllocate(sizeof (XENBUS_GNTTAB_PERSISTENT));
+
+    status = STATUS_NO_MEMORY;
+    if (Persistent == NULL)
+        goto fail1;
+
+    status = GnttabPermitForeignAccess(Context,
+                                       Cache,
+                                       TRUE,
+                                       Domain,
+                                       Pfn,
+                                       ReadOnly,
+                                       &Persistent->Descriptor);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    Persistent->Domain = Domain;
+    Persistent->Pfn = Pfn;
+    Persistent->ReadOnly = ReadOnly;
+
+    InsertTailList(&Cache->PersistentHash[__GnttabPersistentHash(Domain, Pfn)],
+                   &Persistent->HashEntry);
+    Cache->PersistentCount++;
+
+done:
+    InsertHeadList(&Cache->PersistentLru, &Persistent->LruEntry);
+    Persistent->References++;
+
+    *Descriptor = Persistent->Descriptor;
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    __GnttabFree(Persistent);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    return status;
+}
+
+// The grant stays in place so that it can be found again by
+// GnttabPermitForeignAccessPersistent until it is evicted
+static NTSTATUS
+GnttabRevokeForeignAccessPersistent(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor
+    )
+{
+    grant_entry_v1_t                *Entry;
+    PXENBUS_GNTTAB_PERSISTENT       Persistent;
+    NTSTATUS                        status;
+
+    __GnttabAuditDescriptor(Context, Descriptor);
+
+    Entry = &Context->Entry[Descriptor->Reference];
+
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    Persistent = __GnttabLookupPersistent(Cache,
+                                          Entry->domid,
+                                          Entry->frame,
+                                          (Entry->flags & GTF_readonly) ? TRUE : FALSE);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Persistent == NULL || Persistent->Descriptor != Descriptor)
+        goto fail1;
+
+    ASSERT(Persistent->References != 0);
+    --Persistent->References;
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    return status;
+}
+
+static NTSTATUS
+__GnttabCopyBatch(
+    IN  USHORT                          Domain,
+    IN  XENBUS_GNTTAB_COPY_DIRECTION    Direction,
+    IN  PXENBUS_GNTTAB_COPY_SEGMENT     Segment[],
+    IN  ULONG                           Count
+    )
+{
+    struct gnttab_copy                  op[GNTTAB_COPY_BATCH_SIZE];
+    ULONG                               Index;
+    NTSTATUS                            status;
+
+    ASSERT3U(Count, <=, GNTTAB_COPY_BATCH_SIZE);
+
+    RtlZeroMemory(op, sizeof (op));
+
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_GNTTAB_COPY_SEGMENT     Next = Segment[Index];
+
+        ASSERT3U(Next->Offset + Next->Length, <=, PAGE_SIZE);
+        ASSERT3U(Next->RemoteOffset + Next->Length, <=, PAGE_SIZE);
+
+        if (Direction == GNTTAB_COPY_TO_REMOTE) {
+            op[Index].source.u.gmfn = (xen_pfn_t)Next->Pfn;
+            op[Index].source.domid = DOMID_SELF;
+            op[Index].source.offset = Next->Offset;
+
+            op[Index].dest.u.ref = Next->Reference;
+            op[Index].dest.domid = Domain;
+            op[Index].dest.offset = Next->RemoteOffset;
+
+            op[Index].flags = GNTCOPY_dest_gref;
+        } else {
+            op[Index].source.u.ref = Next->Reference;
+            op[Index].source.domid = Domain;
+            op[Index].source.offset = Next->RemoteOffset;
+
+            op[Index].dest.u.gmfn = (xen_pfn_t)Next->Pfn;
+            op[Index].dest.domid = DOMID_SELF;
+            op[Index].dest.offset = Next->Offset;
+
+            op[Index].flags = GNTCOPY_source_gref;
+        }
+
+        op[Index].len = Next->Length;
+    }
+
+    status = GrantTableCopy(op, Count);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = STATUS_SUCCESS;
+
+    for (Index = 0; Index < Count; Index++) {
+        Segment[Index]->Status = op[Index].status;
+
+        if (op[Index].status != GNTST_okay)
+            status = STATUS_UNSUCCESSFUL;
+    }
+
+    return status;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    for (Index = 0; Index < Count; Index++)
+        Segment[Index]->Status = GNTST_general_error;
+
+    return status;
+}
+
+// Segments are copied in batches of GNTTAB_COPY_BATCH_SIZE and the
+// Status of every segment is filled in, even if an earlier one failed
+static NTSTATUS
+GnttabCopy(
+    IN  PXENBUS_GNTTAB_CONTEXT          Context,
+    IN  USHORT                          Domain,
+    IN  XENBUS_GNTTAB_COPY_DIRECTION    Direction,
+    IN  PXENBUS_GNTTAB_COPY_SEGMENT     Segment[],
+    IN  ULONG                           Count
+    )
+{
+    ULONG                               Index;
+    NTSTATUS                            status;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    status = STATUS_SUCCESS;
+
+    for (Index = 0; Index < Count; Index += GNTTAB_COPY_BATCH_SIZE) {
+        NTSTATUS    Batch;
+
+        Batch = __GnttabCopyBatch(Domain,
+                                  Direction,
+                                  &Segment[Index],
+                                  __min(Count - Index, GNTTAB_COPY_BATCH_SIZE));
+        if (!NT_SUCCESS(Batch))
+            status = Batch;
+    }
+
+    return status;
+}
+
+static FORCEINLINE ULONGLONG
+__GnttabForeignHostAddress(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  ULONG                   Page
+    )
+{
+    return (ULONGLONG)(Context->ForeignPfn + Page) << PAGE_SHIFT;
+}
+
+static NTSTATUS
+__GnttabUnmapForeignBatch(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  ULONG                       Page,
+    IN  ULONG                       Count
+    )
+{
+    struct gnttab_unmap_grant_ref   op[GNTTAB_MAP_BATCH_SIZE];
+    ULONG                           Index;
+    NTSTATUS                        status;
+
+    ASSERT3U(Count, <=, GNTTAB_MAP_BATCH_SIZE);
+
+    RtlZeroMemory(op, sizeof (op));
+
+    for (Index = 0; Index < Count; Index++) {
+        op[Index].host_addr = __GnttabForeignHostAddress(Context, Page + Index);
+        op[Index].handle = Context->ForeignPage[Page + Index].Handle;
+
+        // Overwritten by Xen for each op that it processes
+        op[Index].status = GNTST_general_error;
+    }
+
+    status = GrantTableUnmapGrantRef(op, Count);
+
+    // Even if the hypercall failed some ops may have been processed, and
+    // a failed op does not stop Xen processing the ones after it, so
+    // clear the handle of every page that did get unmapped
+    for (Index = 0; Index < Count; Index++) {
+        if (op[Index].status != GNTST_okay) {
+            Error("%u: handle %08x (%d)\n",
+                  Page + Index,
+                  op[Index].handle,
+                  op[Index].status);
+
+            if (NT_SUCCESS(status))
+                status = STATUS_UNSUCCESSFUL;
+
+            continue;
+        }
+
+        Context->ForeignPage[Page + Index].Handle = 0;
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+__GnttabMapForeignBatch(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  USHORT                      Domain,
+    IN  ULONG                       Page,
+    IN  PULONG                      References,
+    IN  ULONG                       Count,
+    IN  BOOLEAN                     ReadOnly,
+    OUT PBOOLEAN                    Leak
+    )
+{
+    struct gnttab_map_grant_ref     op[GNTTAB_MAP_BATCH_SIZE];
+    ULONG                           Index;
+    NTSTATUS                        status;
+
+    ASSERT3U(Count, <=, GNTTAB_MAP_BATCH_SIZE);
+
+    RtlZeroMemory(op, sizeof (op));
+
+    for (Index = 0; Index < Count; Index++) {
+        op[Index].host_addr = __GnttabForeignHostAddress(Context, Page + Index);
+        op[Index].flags = GNTMAP_host_map;
+        if (ReadOnly)
+            op[Index].flags |= GNTMAP_readonly;
+        op[Index].ref = References[Index];
+        op[Index].dom = Domain;
+
+        // Overwritten by Xen for each op that it processes
+        op[Index].status = GNTST_general_error;
+    }
+
+    status = GrantTableMapGrantRef(op, Count);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = STATUS_SUCCESS;
+
+    for (Index = 0; Index < Count; Index++) {
+        if (op[Index].status != GNTST_okay) {
+            Error("%u: ref %08x (%d)\n",
+                  Page + Index,
+                  References[Index],
+                  op[Index].status);
+
+            status = STATUS_UNSUCCESSFUL;
+            continue;
+        }
+
+        Context->ForeignPage[Page + Index].Handle = op[Index].handle;
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    // Undo whatever did get mapped. If that fails then the pages are
+    // still backed by foreign grants so the caller must not re-use them.
+    for (Index = 0; Index < Count; Index++) {
+        if (op[Index].status != GNTST_okay)
+            continue;
+
+        Context->ForeignPage[Page + Index].Handle = op[Index].handle;
+
+        if (!NT_SUCCESS(__GnttabUnmapForeignBatch(Context, Page + Index, 1)))
+            *Leak = TRUE;
+    }
+
+    return status;
+}
+
+static NTSTATUS
+GnttabMapForeignPages(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  USHORT                  Domain,
+    IN  ULONG                   NumberPages,
+    IN  PULONG                  References,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PVOID                   *Address
+    )
+{
+    LONGLONG                    Start;
+    ULONG                       Page;
+    ULONG                       Index;
+    BOOLEAN                     Leak;
+    NTSTATUS                    status;
+
+    status = STATUS_NOT_SUPPORTED;
+    if (Context->ForeignRangeSet == NULL)
         goto fail1;
 
-    (*Descriptor)->Entry.flags = (ReadOnly) ? GTF_readonly : 0;
-    (*Descriptor)->Entry.domid = Domain;
+    status = STATUS_INVALID_PARAMETER;
+    if (NumberPages == 0)
+        goto fail2;
 
-    (*Descriptor)->Entry.frame = (uint32_t)Pfn;
-    ASSERT3U((*Descriptor)->Entry.frame, ==, Pfn);
+    status = RangeSetPopMany(Context->ForeignRangeSet, NumberPages, &Start);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
-    Entry = &Context->Entry[(*Descriptor)->Reference];
+    Page = (ULONG)Start;
+    Leak = FALSE;
+
+    for (Index = 0; Index < NumberPages; Index += GNTTAB_MAP_BATCH_SIZE) {
+        status = __GnttabMapForeignBatch(Context,
+                                         Domain,
+                                         Page + Index,
+                                         &References[Index],
+                                         __min(NumberPages - Index, GNTTAB_MAP_BATCH_SIZE),
+                                         ReadOnly,
+                                         &Leak);
+        if (!NT_SUCCESS(status))
+            goto fail4;
+    }
 
-    *Entry = (*Descriptor)->Entry;
-    KeMemoryBarrier();
+    Context->ForeignPage[Page].Count = NumberPages;
 
-    Entry->flags |= GTF_permit_access;
-    KeMemoryBarrier();
+    *Address = Context->ForeignAddress + ((ULONG_PTR)Page << PAGE_SHIFT);
 
     return STATUS_SUCCESS;
 
+fail4:
+    Error("fail4\n");
+
+    while (Index != 0) {
+        ULONG   Count;
+
+        Count = __min(Index, GNTTAB_MAP_BATCH_SIZE);
+        Index -= Count;
+
+        if (!NT_SUCCESS(__GnttabUnmapForeignBatch(Context, Page + Index, Count)))
+            Leak = TRUE;
+    }
+
+    // As in GnttabUnmapForeignPages, address space that may still be
+    // mapped cannot safely be re-used so it is leaked
+    if (!Leak)
+        (VOID) RangeSetPut(Context->ForeignRangeSet,
+                           Page,
+                           Page + NumberPages - 1);
+    else
+        Error("leaking foreign pages %u - %u\n",
+              Page,
+              Page + NumberPages - 1);
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -372,56 +1878,70 @@ fail1:
 }
 
 static NTSTATUS
-GnttabRevokeForeignAccess(
-    IN  PXENBUS_GNTTAB_CONTEXT      Context,
-    IN  PXENBUS_GNTTAB_CACHE        Cache,
-    IN  BOOLEAN                     Locked,
-    IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor
+GnttabUnmapForeignPages(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PVOID                   Address
     )
 {
-    grant_entry_v1_t                *Entry;
-    volatile SHORT                  *Flags;
-    ULONG                           Attempt;
-    NTSTATUS                        status;
+    ULONG_PTR                   Offset;
+    ULONG                       Page;
+    ULONG                       NumberPages;
+    ULONG                       Index;
+    NTSTATUS                    status;
 
-    ASSERT3U(Descriptor->Magic, ==, GNTTAB_DESCRIPTOR_MAGIC);
-    ASSERT3U(Descriptor->Reference, >=, GNTTAB_RESERVED_ENTRY_COUNT);
-    ASSERT3U(Descriptor->Reference, <, (Context->FrameIndex + 1) * GNTTAB_ENTRY_PER_FRAME);
+    Offset = (PUCHAR)Address - Context->ForeignAddress;
 
-    Entry = &Context->Entry[Descriptor->Reference];
-    Flags = (volatile SHORT *)&Entry->flags;
+    status = STATUS_INVALID_PARAMETER;
+    if (Context->ForeignRangeSet == NULL ||
+        (PUCHAR)Address < Context->ForeignAddress ||
+        (Offset & (PAGE_SIZE - 1)) != 0 ||
+        (Offset >> PAGE_SHIFT) >= Context->ForeignPageCount)
+        goto fail1;
 
-    Attempt = 0;
-    while (Attempt++ < 100) {
-        uint16_t    Old;
-        uint16_t    New;
+    Page = (ULONG)(Offset >> PAGE_SHIFT);
 
-        Old = *Flags;
-        Old &= ~(GTF_reading | GTF_writing);
+    NumberPages = Context->ForeignPage[Page].Count;
+    if (NumberPages == 0)
+        goto fail2;
 
-        New = Old & ~GTF_permit_access;
+    // The run is forgotten whatever happens below so that a retry cannot
+    // unmap it again
+    Context->ForeignPage[Page].Count = 0;
 
-        if (InterlockedCompareExchange16(Flags, New, Old) == Old)
-            break;
+    status = STATUS_SUCCESS;
 
-        SchedYield();
-    }
+    for (Index = 0; Index < NumberPages; Index += GNTTAB_MAP_BATCH_SIZE) {
+        NTSTATUS    BatchStatus;
 
-    status = STATUS_UNSUCCESSFUL;
-    if (Attempt == 100)
-        goto fail1;
+        // Carry on after a failure so that as little as possible is
+        // left mapped
+        BatchStatus = __GnttabUnmapForeignBatch(Context,
+                                                Page + Index,
+                                                __min(NumberPages - Index, GNTTAB_MAP_BATCH_SIZE));
+        if (!NT_SUCCESS(BatchStatus) && NT_SUCCESS(status))
+            status = BatchStatus;
+    }
 
-    RtlZeroMemory(Entry, sizeof (grant_entry_v1_t));
-    RtlZeroMemory(&Descriptor->Entry, sizeof (grant_entry_v1_t));
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
-    CACHE(Put,
-          Context->CacheInterface,
-          Cache->Cache,
-          Descriptor,
-          Locked);
+    (VOID) RangeSetPut(Context->ForeignRangeSet,
+                       Page,
+                       Page + NumberPages - 1);
 
     return STATUS_SUCCESS;
 
+fail3:
+    Error("fail3\n");
+
+    // The address space cannot safely be re-used so it is leaked
+    Error("leaking foreign pages %u - %u\n",
+          Page,
+          Page + NumberPages - 1);
+
+fail2:
+    Error("fail2\n");
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -434,9 +1954,7 @@ GnttabReference(
     IN  PXENBUS_GNTTAB_DESCRIPTOR   Descriptor
     )
 {
-    UNREFERENCED_PARAMETER(Context);
-
-    ASSERT3U(Descriptor->Magic, ==, GNTTAB_DESCRIPTOR_MAGIC);
+    __GnttabAuditDescriptor(Context, Descriptor);
 
     return (ULONG)Descriptor->Reference;
 }
@@ -467,6 +1985,118 @@ static XENBUS_GNTTAB_OPERATIONS  Operations = {
 
 #undef GNTTAB_OPERATION
 
+// Mapping foreign grants is optional so failure here just leaves the
+// window empty and the map operations unsupported
+static VOID
+__GnttabForeignInitialize(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_RESOURCE        Memory
+    )
+{
+    PHYSICAL_ADDRESS            Address;
+    NTSTATUS                    status;
+
+    Context->ForeignPfn = (PFN_NUMBER)(Memory->Translated.u.Memory.Start.QuadPart >> PAGE_SHIFT);
+    Context->ForeignPageCount = (ULONG)__min(GNTTAB_FOREIGN_PAGE_COUNT,
+                                             Memory->Translated.u.Memory.Length >> PAGE_SHIFT);
+
+    Info("foreign pages: %u\n", Context->ForeignPageCount);
+
+    if (Context->ForeignPageCount == 0)
+        goto done;
+
+    Memory->Translated.u.Memory.Start.QuadPart += (Context->ForeignPageCount * PAGE_SIZE);
+    Memory->Translated.u.Memory.Length -= (Context->ForeignPageCount * PAGE_SIZE);
+
+    Context->ForeignPage = __GnttabAllocate(sizeof (XENBUS_GNTTAB_FOREIGN_PAGE) *
+                                            Context->ForeignPageCount);
+
+    status = STATUS_NO_MEMORY;
+    if (Context->ForeignPage == NULL)
+        goto fail1;
+
+    Address.QuadPart = (ULONGLONG)Context->ForeignPfn << PAGE_SHIFT;
+    Context->ForeignAddress = MmMapIoSpace(Address,
+                                           Context->ForeignPageCount * PAGE_SIZE,
+                                           MmCached);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (Context->ForeignAddress == NULL)
+        goto fail2;
+
+    Info("foreign address: %p\n", Context->ForeignAddress);
+
+    status = RangeSetInitialize(&Context->ForeignRangeSet);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    status = RangeSetPut(Context->ForeignRangeSet,
+                         0,
+                         Context->ForeignPageCount - 1);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+done:
+    return;
+
+fail4:
+    Error("fail4\n");
+
+    RangeSetTeardown(Context->ForeignRangeSet);
+    Context->ForeignRangeSet = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    Context->ForeignAddress = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    __GnttabFree(Context->ForeignPage);
+    Context->ForeignPage = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    Memory->Translated.u.Memory.Start.QuadPart -= (Context->ForeignPageCount * PAGE_SIZE);
+    Memory->Translated.u.Memory.Length += (Context->ForeignPageCount * PAGE_SIZE);
+
+    Context->ForeignPageCount = 0;
+    Context->ForeignPfn = 0;
+}
+
+static VOID
+__GnttabForeignTeardown(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context
+    )
+{
+    ULONG                       Count;
+
+    if (Context->ForeignRangeSet == NULL)
+        goto done;
+
+    Count = (ULONG)RangeSetCount(Context->ForeignRangeSet);
+    if (Count != Context->ForeignPageCount)
+        BUG("OUTSTANDING FOREIGN MAPPINGS");
+
+    (VOID) RangeSetGetRange(Context->ForeignRangeSet,
+                            0,
+                            Context->ForeignPageCount - 1);
+
+    RangeSetTeardown(Context->ForeignRangeSet);
+    Context->ForeignRangeSet = NULL;
+
+    Context->ForeignAddress = NULL;
+
+    __GnttabFree(Context->ForeignPage);
+    Context->ForeignPage = NULL;
+
+done:
+    Context->ForeignPageCount = 0;
+    Context->ForeignPfn = 0;
+}
+
 static FORCEINLINE VOID
 __GnttabMap(
     IN  PXENBUS_GNTTAB_CONTEXT  Context
@@ -476,6 +2106,18 @@ __GnttabMap(
     PFN_NUMBER                  Pfn;
     NTSTATUS                    status;
 
+    if (Context->FrameIndex < 0)
+        return;
+
+    status = MemoryAddToPhysmapBatch(XENMAPSPACE_grant_table,
+                                     Context->FrameIndex + 1,
+                                     Context->MapIndex,
+                                     Context->MapPfn,
+                                     Context->MapError);
+    if (NT_SUCCESS(status))
+        return;
+
+    // Older versions of Xen cannot do this in one go
     Pfn = Context->Pfn;
 
     for (Index = 0; Index <= Context->FrameIndex; Index++) {
@@ -508,6 +2150,127 @@ GnttabSuspendCallbackEarly(
     __GnttabMap(Context);
 }
                      
+static FORCEINLINE ULONG
+__GnttabPersistentHitRatio(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context
+    )
+{
+    ULONGLONG                   Hit = Context->PersistentHitCount;
+    ULONGLONG                   Miss = Context->PersistentMissCount;
+
+    if (Hit + Miss == 0)
+        return 0;
+
+    return (ULONG)((Hit * 100) / (Hit + Miss));
+}
+
+static VOID
+__GnttabDebugStatisticsLine(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  const CHAR                  *Name,
+    IN  PXENBUS_GNTTAB_STATISTICS   Statistics,
+    IN  ULONG                       Milliseconds
+    )
+{
+    LONG                            Grants = Statistics->Grants;
+    LONG                            Revokes = Statistics->Revokes;
+    ULONG                           GrantRate = 0;
+    ULONG                           RevokeRate = 0;
+
+    if (Milliseconds != 0) {
+        GrantRate = (ULONG)(((ULONGLONG)(ULONG)(Grants - Statistics->LastGrants) * 1000) / Milliseconds);
+        RevokeRate = (ULONG)(((ULONGLONG)(ULONG)(Revokes - Statistics->LastRevokes) * 1000) / Milliseconds);
+    }
+
+    Statistics->LastGrants = Grants;
+    Statistics->LastRevokes = Revokes;
+
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "- %s: Outstanding = %d (Peak = %d) Grants = %u (%u/s) Revokes = %u (%u/s)\n",
+          Name,
+          Statistics->Outstanding,
+          Statistics->Peak,
+          Grants,
+          GrantRate,
+          Revokes,
+          RevokeRate);
+}
+
+static VOID
+__GnttabDebugStatistics(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context
+    )
+{
+    ULONGLONG                   Now;
+    ULONG                       Milliseconds;
+    PLIST_ENTRY                 ListEntry;
+    ULONG                       Index;
+
+    // Rates are averaged over the time since the previous call
+    Now = KeQueryInterruptTime();
+    Milliseconds = (ULONG)((Now - Context->StatisticsTime) / 10000);
+    Context->StatisticsTime = Now;
+
+    if (!IsListEmpty(&Context->CacheList)) {
+        DEBUG(Printf,
+              Context->DebugInterface,
+              Context->DebugCallback,
+              "CACHES:\n");
+
+        for (ListEntry = Context->CacheList.Flink;
+             ListEntry != &Context->CacheList;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_GNTTAB_CACHE    Cache;
+
+            Cache = CONTAINING_RECORD(ListEntry, XENBUS_GNTTAB_CACHE, ListEntry);
+
+            __GnttabSampleCache(Cache);
+            __GnttabDebugStatisticsLine(Context,
+                                        Cache->Name,
+                                        &Cache->Statistics,
+                                        Milliseconds);
+        }
+    }
+
+    if (Context->Domain[0].Id == 0)
+        return;
+
+    __GnttabSampleDomains(Context);
+
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "DOMAINS:\n");
+
+    for (Index = 0; Index < GNTTAB_DOMAIN_COUNT; Index++) {
+        PXENBUS_GNTTAB_DOMAIN   Slot = &Context->Domain[Index];
+        CHAR                    Name[sizeof ("65535")];
+        NTSTATUS                status;
+
+        if (Slot->Id == 0)
+            break;
+
+        status = RtlStringCbPrintfA(Name,
+                                    sizeof (Name),
+                                    "%u",
+                                    Slot->Id - 1);
+        ASSERT(NT_SUCCESS(status));
+
+        __GnttabDebugStatisticsLine(Context,
+                                    Name,
+                                    &Slot->Statistics,
+                                    Milliseconds);
+    }
+
+    if (Context->OtherDomains.Grants != 0)
+        __GnttabDebugStatisticsLine(Context,
+                                    "other",
+                                    &Context->OtherDomains,
+                                    Milliseconds);
+}
+
 static VOID
 GnttabDebugCallback(
     IN  PVOID               Argument,
@@ -529,6 +2292,46 @@ GnttabDebugCallback(
           Context->DebugCallback,
           "FrameIndex = %d\n",
           Context->FrameIndex);
+
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "MaximumFrameCount = %d\n",
+          Context->MaximumFrameCount);
+
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "ExpandCount = %u\n",
+          Context->ExpandCount);
+
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "DEFERRED: Deferred = %u Retried = %u Leaked = %u\n",
+          Context->DeferredCount,
+          Context->RetryCount,
+          Context->LeakCount);
+
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "PERSISTENT: Hit = %u Miss = %u (%u%%) Overflow = %u\n",
+          Context->PersistentHitCount,
+          Context->PersistentMissCount,
+          __GnttabPersistentHitRatio(Context),
+          Context->PersistentOverflowCount);
+
+    if (Context->ForeignRangeSet != NULL)
+        DEBUG(Printf,
+              Context->DebugInterface,
+              Context->DebugCallback,
+              "FOREIGN: Pfn = %p Pages = %u Free = %u\n",
+              (PVOID)Context->ForeignPfn,
+              Context->ForeignPageCount,
+              (ULONG)RangeSetCount(Context->ForeignRangeSet));
+
+    __GnttabDebugStatistics(Context);
 }
                      
 NTSTATUS
@@ -539,7 +2342,12 @@ GnttabInitialize(
 {
     PXENBUS_RESOURCE                Memory;
     PHYSICAL_ADDRESS                Address;
+    uint32_t                        Current;
+    uint32_t                        Maximum;
+    LONG                            Index;
     PXENBUS_GNTTAB_CONTEXT          Context;
+    HANDLE                          ParametersKey;
+    ULONG                           PublishStatistics;
     NTSTATUS                        status;
 
     Trace("====>\n");
@@ -554,26 +2362,94 @@ GnttabInitialize(
     Context->Pfn = (PFN_NUMBER)(Memory->Translated.u.Memory.Start.QuadPart >> PAGE_SHIFT);
     Context->FrameIndex = -1;
 
+    status = GrantTableQuerySize(&Current, &Maximum);
+    if (!NT_SUCCESS(status)) {
+        Current = 0;
+        Maximum = GNTTAB_DEFAULT_FRAME_COUNT;
+    }
+
+    // We cannot use more frames than there is space left in the BAR
+    Context->MaximumFrameCount = (LONG)__min(Maximum,
+                                             Memory->Translated.u.Memory.Length >> PAGE_SHIFT);
+
+    Info("frames: current %u maximum %u (using %d)\n",
+         Current,
+         Maximum,
+         Context->MaximumFrameCount);
+
+    // Pre-built so that frames can be re-added in one batch on resume
+    Context->MapIndex = __GnttabAllocate(Context->MaximumFrameCount *
+                                         (sizeof (ULONG_PTR) +
+                                          sizeof (PFN_NUMBER) +
+                                          sizeof (LONG)));
+
+    status = STATUS_NO_MEMORY;
+    if (Context->MapIndex == NULL)
+        goto fail2;
+
+    Context->MapPfn = (PPFN_NUMBER)(Context->MapIndex + Context->MaximumFrameCount);
+    Context->MapError = (PLONG)(Context->MapPfn + Context->MaximumFrameCount);
+
+    for (Index = 0; Index < Context->MaximumFrameCount; Index++) {
+        Context->MapIndex[Index] = Index;
+        Context->MapPfn[Index] = Context->Pfn + Index;
+    }
+
     __GnttabMap(Context);
 
-    Memory->Translated.u.Memory.Start.QuadPart += (GNTTAB_MAXIMUM_FRAME_COUNT * PAGE_SIZE);
+    Memory->Translated.u.Memory.Start.QuadPart += (Context->MaximumFrameCount * PAGE_SIZE);
 
-    ASSERT3U(Memory->Translated.u.Memory.Length, >=, (GNTTAB_MAXIMUM_FRAME_COUNT * PAGE_SIZE));
-    Memory->Translated.u.Memory.Length -= (GNTTAB_MAXIMUM_FRAME_COUNT * PAGE_SIZE);
+    ASSERT3U(Memory->Translated.u.Memory.Length, >=, (Context->MaximumFrameCount * PAGE_SIZE));
+    Memory->Translated.u.Memory.Length -= (Context->MaximumFrameCount * PAGE_SIZE);
 
     Address.QuadPart = (ULONGLONG)Context->Pfn << PAGE_SHIFT;
     Context->Entry = (grant_entry_v1_t *)MmMapIoSpace(Address,
-                                                      GNTTAB_MAXIMUM_FRAME_COUNT * PAGE_SIZE,
+                                                      Context->MaximumFrameCount * PAGE_SIZE,
                                                       MmCached);
     status = STATUS_UNSUCCESSFUL;
     if (Context->Entry == NULL)
-        goto fail2;
+        goto fail3;
 
     Info("grant_entry_v1_t *: %p\n", Context->Entry);
 
+    __GnttabForeignInitialize(Context, Memory);
+
     status = RangeSetInitialize(&Context->RangeSet);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail4;
+
+    KeInitializeSpinLock(&Context->ExpandLock);
+
+    KeInitializeSpinLock(&Context->DeferredLock);
+    InitializeListHead(&Context->DeferredList);
+    KeInitializeDpc(&Context->DeferredDpc, GnttabDeferredDpc, Context);
+    KeInitializeTimer(&Context->DeferredTimer);
+
+    KeInitializeSpinLock(&Context->CacheLock);
+    InitializeListHead(&Context->CacheList);
+    Context->StatisticsTime = KeQueryInterruptTime();
+
+    ParametersKey = DriverGetParametersKey();
+
+    PublishStatistics = 0;
+
+    if (ParametersKey != NULL) {
+        status = RegistryQueryDwordValue(ParametersKey,
+                                         "GnttabPublishStatistics",
+                                         &PublishStatistics);
+        if (!NT_SUCCESS(status))
+            PublishStatistics = 0;
+    }
+
+    if (PublishStatistics != 0) {
+        Context->StoreInterface = FdoGetStoreInterface(Fdo);
+
+        STORE(Acquire, Context->StoreInterface);
+    }
+
+    status = ThreadCreate(GnttabExpand, Context, &Context->ExpandThread);
+    if (!NT_SUCCESS(status))
+        goto fail5;
 
     Context->CacheInterface = FdoGetCacheInterface(Fdo);
 
@@ -590,7 +2466,7 @@ GnttabInitialize(
                      Context,
                      &Context->SuspendCallbackEarly);
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail6;
 
     Context->DebugInterface = FdoGetDebugInterface(Fdo);
 
@@ -603,7 +2479,7 @@ GnttabInitialize(
                    Context,
                    &Context->DebugCallback);
     if (!NT_SUCCESS(status))
-        goto fail5;
+        goto fail7;
 
     Interface->Context = Context;
     Interface->Operations = &Operations;
@@ -612,8 +2488,8 @@ GnttabInitialize(
 
     return STATUS_SUCCESS;
 
-fail5:
-    Error("fail5\n");
+fail7:
+    Error("fail7\n");
 
     DEBUG(Release, Context->DebugInterface);
     Context->DebugInterface = NULL;
@@ -623,8 +2499,8 @@ fail5:
             Context->SuspendCallbackEarly);
     Context->SuspendCallbackEarly = NULL;
 
-fail4:
-    Error("fail4\n");
+fail6:
+    Error("fail6\n");
 
     SUSPEND(Release, Context->SuspendInterface);
     Context->SuspendInterface = NULL;
@@ -632,20 +2508,55 @@ fail4:
     CACHE(Release, Context->CacheInterface);
     Context->CacheInterface = NULL;
 
+    ThreadAlert(Context->ExpandThread);
+    ThreadJoin(Context->ExpandThread);
+    Context->ExpandThread = NULL;
+
+fail5:
+    Error("fail5\n");
+
+    if (Context->StoreInterface != NULL) {
+        STORE(Release, Context->StoreInterface);
+        Context->StoreInterface = NULL;
+    }
+
+    Context->StatisticsTime = 0;
+    RtlZeroMemory(&Context->CacheList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Context->CacheLock, sizeof (KSPIN_LOCK));
+
+    RtlZeroMemory(&Context->DeferredTimer, sizeof (KTIMER));
+    RtlZeroMemory(&Context->DeferredDpc, sizeof (KDPC));
+    RtlZeroMemory(&Context->DeferredList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Context->DeferredLock, sizeof (KSPIN_LOCK));
+
+    RtlZeroMemory(&Context->ExpandLock, sizeof (KSPIN_LOCK));
+
     RangeSetTeardown(Context->RangeSet);
 
+fail4:
+    Error("fail4\n");
+
+    __GnttabForeignTeardown(Context);
+
+    Context->Entry = NULL;
+
 fail3:
     Error("fail3\n");
 
-    Context->Entry = NULL;
+    __GnttabUnmap(Context);
+
+    __GnttabFree(Context->MapIndex);
+    Context->MapIndex = NULL;
+    Context->MapPfn = NULL;
+    Context->MapError = NULL;
 
 fail2:
     Error("fail2\n");
 
-    __GnttabUnmap(Context);
-
     ASSERT3S(Context->FrameIndex, ==, -1);
     Context->FrameIndex = 0;
+    Context->MaximumFrameCount = 0;
+    Context->ExpandCount = 0;
     Context->Pfn = 0;
 
     ASSERT(IsZeroMemory(Context, sizeof (XENBUS_GNTTAB_CONTEXT)));
@@ -687,15 +2598,65 @@ GnttabTeardown(
     CACHE(Release, Context->CacheInterface);
     Context->CacheInterface = NULL;
 
+    ThreadAlert(Context->ExpandThread);
+    ThreadJoin(Context->ExpandThread);
+    Context->ExpandThread = NULL;
+
+    RtlZeroMemory(&Context->ExpandLock, sizeof (KSPIN_LOCK));
+
+    KeCancelTimer(&Context->DeferredTimer);
+    KeFlushQueuedDpcs();
+
+    if (!IsListEmpty(&Context->DeferredList))
+        BUG("OUTSTANDING DEFERRED REVOCATIONS");
+
+    RtlZeroMemory(&Context->DeferredTimer, sizeof (KTIMER));
+    RtlZeroMemory(&Context->DeferredDpc, sizeof (KDPC));
+    RtlZeroMemory(&Context->DeferredList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Context->DeferredLock, sizeof (KSPIN_LOCK));
+
+    Context->DeferredCount = 0;
+    Context->RetryCount = 0;
+    Context->LeakCount = 0;
+
+    Context->PersistentHitCount = 0;
+    Context->PersistentMissCount = 0;
+    Context->PersistentOverflowCount = 0;
+
+    if (Context->StoreInterface != NULL) {
+        STORE(Release, Context->StoreInterface);
+        Context->StoreInterface = NULL;
+    }
+
+    if (!IsListEmpty(&Context->CacheList))
+        BUG("OUTSTANDING CACHES");
+
+    RtlZeroMemory(Context->DomainCpu, sizeof (Context->DomainCpu));
+    RtlZeroMemory(&Context->OtherDomains, sizeof (XENBUS_GNTTAB_STATISTICS));
+    RtlZeroMemory(Context->Domain, sizeof (Context->Domain));
+
+    Context->StatisticsTime = 0;
+    RtlZeroMemory(&Context->CacheList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Context->CacheLock, sizeof (KSPIN_LOCK));
+
     __GnttabShrink(Context);
     RangeSetTeardown(Context->RangeSet);
 
+    __GnttabForeignTeardown(Context);
+
     Context->Entry = NULL;
 
     __GnttabUnmap(Context);
 
+    __GnttabFree(Context->MapIndex);
+    Context->MapIndex = NULL;
+    Context->MapPfn = NULL;
+    Context->MapError = NULL;
+
     ASSERT3S(Context->FrameIndex, ==, -1);
     Context->FrameIndex = 0;
+    Context->MaximumFrameCount = 0;
+    Context->ExpandCount = 0;
     Context->Pfn = 0;
 
     ASSERT(IsZeroMemory(Context, sizeof (XENBUS_GNTTAB_CONTEXT)));
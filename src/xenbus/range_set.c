@@ -95,6 +95,21 @@ RangeSetIsEmpty(
     return IsEmpty;
 }
 
+ULONGLONG
+RangeSetCount(
+    IN  PXENBUS_RANGE_SET   RangeSet
+    )
+{
+    ULONGLONG               Count;
+    KIRQL                   Irql;
+
+    KeAcquireSpinLock(&RangeSet->Lock, &Irql);
+    Count = RangeSet->ItemCount;
+    KeReleaseSpinLock(&RangeSet->Lock, Irql);
+
+    return Count;
+}
+
 #if RANGE_SET_AUDIT
 static FORCEINLINE VOID
 __RangeSetAudit(
@@ -286,6 +301,67 @@ fail1:
     return status;
 }
 
+// Remove the first run of Count contiguous items
+NTSTATUS
+RangeSetPopMany(
+    IN  PXENBUS_RANGE_SET   RangeSet,
+    IN  ULONGLONG           Count,
+    OUT PLONGLONG           Start
+    )
+{
+    PLIST_ENTRY             ListEntry;
+    PRANGE                  Range;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    ASSERT(Count != 0);
+
+    KeAcquireSpinLock(&RangeSet->Lock, &Irql);
+
+#if RANGE_SET_AUDIT
+    __RangeSetAudit(RangeSet);
+#endif
+
+    for (ListEntry = RangeSet->List.Flink;
+         ListEntry != &RangeSet->List;
+         ListEntry = ListEntry->Flink) {
+        Range = CONTAINING_RECORD(ListEntry, RANGE, ListEntry);
+
+        if ((ULONGLONG)(Range->End + 1 - Range->Start) >= Count)
+            goto found;
+    }
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    goto fail1;
+
+found:
+    RangeSet->Cursor = ListEntry;
+
+    *Start = Range->Start;
+    Range->Start += Count;
+
+    ASSERT3U(RangeSet->ItemCount, >=, Count);
+    RangeSet->ItemCount -= Count;
+
+    if (Range->Start > Range->End)
+        __RangeSetRemove(RangeSet, TRUE);
+
+#if RANGE_SET_AUDIT
+    __RangeSetAudit(RangeSet);
+#endif
+
+    KeReleaseSpinLock(&RangeSet->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    KeReleaseSpinLock(&RangeSet->Lock, Irql);
+
+    return status;
+}
+
 static FORCEINLINE NTSTATUS
 __RangeSetAdd(
     IN  PXENBUS_RANGE_SET   RangeSet,
@@ -455,6 +531,116 @@ fail1:
     return status;    
 }
 
+// Remove [Start, End], which must lie within a single range
+NTSTATUS
+RangeSetGetRange(
+    IN  PXENBUS_RANGE_SET   RangeSet,
+    IN  LONGLONG            Start,
+    IN  LONGLONG            End
+    )
+{
+    PLIST_ENTRY             Cursor;
+    PRANGE                  Range;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    ASSERT3S(Start, <=, End);
+
+    KeAcquireSpinLock(&RangeSet->Lock, &Irql);
+
+#if RANGE_SET_AUDIT
+    __RangeSetAudit(RangeSet);
+#endif
+
+    status = STATUS_INVALID_PARAMETER;
+    if (__RangeSetIsEmpty(RangeSet))
+        goto fail1;
+
+    Cursor = RangeSet->Cursor;
+    ASSERT(Cursor != &RangeSet->List);
+
+    Range = CONTAINING_RECORD(Cursor, RANGE, ListEntry);
+
+    while (Start < Range->Start) {
+        Cursor = Cursor->Blink;
+        if (Cursor == &RangeSet->List)
+            goto fail2;
+
+        Range = CONTAINING_RECORD(Cursor, RANGE, ListEntry);
+    }
+
+    while (Start > Range->End) {
+        Cursor = Cursor->Flink;
+        if (Cursor == &RangeSet->List)
+            goto fail3;
+
+        Range = CONTAINING_RECORD(Cursor, RANGE, ListEntry);
+    }
+
+    if (Start < Range->Start || End > Range->End)
+        goto fail4;
+
+    RangeSet->Cursor = Cursor;
+
+    if (Start == Range->Start && End == Range->End) {
+        Range->Start = End + 1;     // Invalidate
+        __RangeSetRemove(RangeSet, TRUE);
+        goto done;
+    }
+
+    if (Start == Range->Start) {
+        Range->Start = End + 1;
+        goto done;
+    }
+
+    if (End == Range->End) {
+        Range->End = Start - 1;
+        goto done;
+    }
+
+    // We need to split a range
+    status = __RangeSetAdd(RangeSet, End + 1, Range->End, TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    Range->End = Start - 1;
+
+done:
+    ASSERT3U(RangeSet->ItemCount, >=, (ULONGLONG)(End + 1 - Start));
+    RangeSet->ItemCount -= End + 1 - Start;
+
+#if RANGE_SET_AUDIT
+    __RangeSetAudit(RangeSet);
+#endif
+
+    KeReleaseSpinLock(&RangeSet->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+#if RANGE_SET_AUDIT
+    __RangeSetAudit(RangeSet);
+#endif
+
+    KeReleaseSpinLock(&RangeSet->Lock, Irql);
+
+    return status;
+}
+
 static FORCEINLINE NTSTATUS
 __RangeSetAddAfter(
     IN  PXENBUS_RANGE_SET   RangeSet,
@@ -41,18 +41,37 @@ RangeSetIsEmpty(
     IN  PXENBUS_RANGE_SET   RangeSet
     );
 
+extern ULONGLONG
+RangeSetCount(
+    IN  PXENBUS_RANGE_SET   RangeSet
+    );
+
 extern NTSTATUS
 RangeSetPop(
     IN  PXENBUS_RANGE_SET   RangeSet,
     OUT PLONGLONG           Item
     );
 
+extern NTSTATUS
+RangeSetPopMany(
+    IN  PXENBUS_RANGE_SET   RangeSet,
+    IN  ULONGLONG           Count,
+    OUT PLONGLONG           Start
+    );
+
 extern NTSTATUS
 RangeSetGet(
     IN  PXENBUS_RANGE_SET   RangeSet,
     IN  LONGLONG            Item
     );
 
+extern NTSTATUS
+RangeSetGetRange(
+    IN  PXENBUS_RANGE_SET   RangeSet,
+    IN  LONGLONG            Start,
+    IN  LONGLONG            End
+    );
+
 extern NTSTATUS
 RangeSetPut(
     IN  PXENBUS_RANGE_SET   RangeSet,
@@ -42,6 +42,7 @@ struct _XENBUS_SHARED_INFO_CONTEXT {
     LONG                        References;
     PFN_NUMBER                  Pfn;
     shared_info_t               *Shared;
+    ULONG                       Port[XEN_LEGACY_MAX_VCPUS];
     PXENBUS_SUSPEND_INTERFACE   SuspendInterface;
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackEarly;
     PXENBUS_DEBUG_INTERFACE     DebugInterface;
@@ -112,37 +113,6 @@ __SharedInfoClearBit(
     return (Old & ((ULONG_PTR)1 << Bit)) ? TRUE : FALSE;    // return TRUE if we cleared the bit
 }
 
-static FORCEINLINE BOOLEAN
-__SharedInfoClearBitUnlocked(
-    IN  ULONG_PTR   *Mask,
-    IN  ULONG       Bit
-    )
-{
-    ULONG_PTR       Old;
-
-    ASSERT3U(Bit, <, sizeof (ULONG_PTR) * 8);
-
-    KeMemoryBarrier();
-
-    Old = *Mask;
-    *Mask = Old & ~((ULONG_PTR)1 << Bit);
-
-    return (Old & ((ULONG_PTR)1 << Bit)) ? TRUE : FALSE;    // return TRUE if we cleared the bit
-}
-
-static FORCEINLINE BOOLEAN
-__SharedInfoTestBit(
-    IN  ULONG_PTR   *Mask,
-    IN  ULONG       Bit
-    )
-{
-    ASSERT3U(Bit, <, sizeof (ULONG_PTR) * 8);
-
-    KeMemoryBarrier();
-
-    return (*Mask & ((ULONG_PTR)1 << Bit)) ? TRUE : FALSE;    // return TRUE if the bit is set
-}
-
 static FORCEINLINE VOID
 __SharedInfoMaskAll(
     IN  PXENBUS_SHARED_INFO_CONTEXT Context
@@ -162,18 +132,48 @@ __SharedInfoMaskAll(
     }
 }
 
+// Find the lowest set bit in Mask at or above Bit
+static FORCEINLINE BOOLEAN
+__SharedInfoScanBit(
+    IN  ULONG_PTR   Mask,
+    IN  ULONG       Bit,
+    OUT PULONG      Index
+    )
+{
+    ASSERT3U(Bit, <, sizeof (ULONG_PTR) * 8);
+
+    Mask &= ~(((ULONG_PTR)1 << Bit) - 1);
+
+#if defined(__i386__)
+    return (BitScanForward(Index, Mask) != 0) ? TRUE : FALSE;
+#elif defined(__x86_64__)
+    return (BitScanForward64(Index, Mask) != 0) ? TRUE : FALSE;
+#else
+#error 'Unrecognised architecture'
+#endif
+}
+
+// Each vCPU has its own selector mask so this must only be called for
+// a given vCPU by one CPU at a time.
 static BOOLEAN
 SharedInfoEvtchnPoll(
     IN  PXENBUS_SHARED_INFO_CONTEXT Context,
+    IN  ULONG                       Cpu,
     IN  BOOLEAN                     (*Function)(PVOID, ULONG),
     IN  PVOID                       Argument
     )
 {
     shared_info_t                   *Shared;
-    static ULONG                    Port;
+    vcpu_info_t                     *Vcpu;
+    ULONG                           Port;
     BOOLEAN                         DoneSomething;
 
+    ASSERT3U(Cpu, <, XEN_LEGACY_MAX_VCPUS);
+
     Shared = Context->Shared;
+    Vcpu = &Shared->vcpu_info[Cpu];
+
+    Port = Context->Port[Cpu];
 
     DoneSomething = FALSE;
 
@@ -183,42 +183,53 @@ SharedInfoEvtchnPoll(
 
         KeMemoryBarrier();
 
-        Pending = _InterlockedExchange8((CHAR *)&Shared->vcpu_info[0].evtchn_upcall_pending, 0);
+        Pending = _InterlockedExchange8((CHAR *)&Vcpu->evtchn_upcall_pending, 0);
         if (Pending == 0)
             break;
 
-        SelectorMask = (ULONG_PTR)InterlockedExchangePointer((PVOID *)&Shared->vcpu_info[0].evtchn_pending_sel, (PVOID)0);
+        SelectorMask = (ULONG_PTR)InterlockedExchangePointer((PVOID *)&Vcpu->evtchn_pending_sel, (PVOID)0);
 
         KeMemoryBarrier();
 
         while (SelectorMask != 0) {
-            ULONG   SelectorBit;
-            ULONG   PortBit;
+            ULONG       SelectorBit;
+            ULONG       PortBit;
+            ULONG_PTR   PortMask;
+            ULONG       Index;
 
             SelectorBit = Port / EVTCHN_PER_SELECTOR;
             PortBit = Port % EVTCHN_PER_SELECTOR;
 
-            if (__SharedInfoTestBit(&SelectorMask, SelectorBit)) {
-                ULONG_PTR   PortMask;
+            // Resume from the cursor, wrapping if nothing is pending
+            // beyond it
+            if (!__SharedInfoScanBit(SelectorMask, SelectorBit, &Index)) {
+                (VOID) __SharedInfoScanBit(SelectorMask, 0, &Index);
+                ASSERT3U(Index, <, SelectorBit);
+            }
 
-                PortMask = Shared->evtchn_pending[SelectorBit];
-                PortMask &= ~Shared->evtchn_mask[SelectorBit];
+            if (Index != SelectorBit) {
+                SelectorBit = Index;
+                PortBit = 0;
+            }
+
+            PortMask = Shared->evtchn_pending[SelectorBit];
+            PortMask &= ~Shared->evtchn_mask[SelectorBit];
 
-                while (PortMask != 0 && PortBit < EVTCHN_PER_SELECTOR) {
-                    if (__SharedInfoTestBit(&PortMask, PortBit)) {
-                        DoneSomething |= Function(Argument, (SelectorBit * EVTCHN_PER_SELECTOR) + PortBit);
+            while (__SharedInfoScanBit(PortMask, PortBit, &Index)) {
+                DoneSomething |= Function(Argument, (SelectorBit * EVTCHN_PER_SELECTOR) + Index);
 
-                        (VOID) __SharedInfoClearBitUnlocked(&PortMask, PortBit);
-                    }
+                PortMask &= ~((ULONG_PTR)1 << Index);
 
-                    PortBit++;
-                }
+                if (++Index == EVTCHN_PER_SELECTOR)
+                    break;
 
-                // Are we done with this selector?
-                if (PortMask == 0)
-                    (VOID) __SharedInfoClearBitUnlocked(&SelectorMask, SelectorBit);
+                PortBit = Index;
             }
 
+            // Are we done with this selector?
+            if (PortMask == 0)
+                SelectorMask &= ~((ULONG_PTR)1 << SelectorBit);
+
             Port = (SelectorBit + 1) * EVTCHN_PER_SELECTOR;
 
             if (Port >= EVTCHN_SELECTOR_COUNT * EVTCHN_PER_SELECTOR)
@@ -226,6 +237,8 @@ SharedInfoEvtchnPoll(
         }
     }
 
+    Context->Port[Cpu] = Port;
+
     return DoneSomething;
 }
 
@@ -359,6 +372,31 @@ SharedInfoGetTime(
     return Now;
 }
 
+// Used by event channel ABIs that do not use the shared bitmaps.
+static BOOLEAN
+SharedInfoUpcallPending(
+    IN  PXENBUS_SHARED_INFO_CONTEXT Context,
+    IN  ULONG                       Cpu
+    )
+{
+    shared_info_t                   *Shared;
+    vcpu_info_t                     *Vcpu;
+    UCHAR                           Pending;
+
+    ASSERT3U(Cpu, <, XEN_LEGACY_MAX_VCPUS);
+
+    Shared = Context->Shared;
+    Vcpu = &Shared->vcpu_info[Cpu];
+
+    KeMemoryBarrier();
+
+    Pending = _InterlockedExchange8((CHAR *)&Vcpu->evtchn_upcall_pending, 0);
+
+    KeMemoryBarrier();
+
+    return (Pending != 0) ? TRUE : FALSE;
+}
+
 static VOID
 SharedInfoAcquire(
     IN  PXENBUS_SHARED_INFO_CONTEXT Context
@@ -618,6 +656,8 @@ SharedInfoTeardown(
     SUSPEND(Release, Context->SuspendInterface);
     Context->SuspendInterface = NULL;
 
+    RtlZeroMemory(Context->Port, sizeof (Context->Port));
+
     Context->Shared = NULL;
 
     __SharedInfoUnmap(Context);
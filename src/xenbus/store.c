@@ -52,6 +52,16 @@ struct _XENBUS_STORE_TRANSACTION {
     BOOLEAN     Active; // Must be tested at >= DISPATCH_LEVEL
 };
 
+#define STORE_PATH_MAGIC 'HTAP'
+
+struct _XENBUS_STORE_PATH {
+    LIST_ENTRY  ListEntry;
+    ULONG       Magic;
+    PVOID       Caller;
+    ULONG       Length;
+    CHAR        Data[1];
+};
+
 #define STORE_WATCH_MAGIC 'CTAW'
 
 struct _XENBUS_STORE_WATCH {
@@ -91,6 +101,12 @@ typedef struct _STORE_RESPONSE {
     ULONG               Index;
 } STORE_RESPONSE, *PSTORE_RESPONSE;
 
+typedef enum _STORE_PRIORITY {
+    STORE_PRIORITY_NORMAL = 0,
+    STORE_PRIORITY_BACKGROUND,
+    STORE_PRIORITY_COUNT
+} STORE_PRIORITY, *PSTORE_PRIORITY;
+
 #define REQUEST_SEGMENT_COUNT   8
 
 typedef struct _STORE_REQUEST {
@@ -101,8 +117,56 @@ typedef struct _STORE_REQUEST {
     ULONG               Index;
     LIST_ENTRY          ListEntry;
     PSTORE_RESPONSE     Response;
+    STORE_PRIORITY      Priority;
+    LARGE_INTEGER       Submitted;
 } STORE_REQUEST, *PSTORE_REQUEST;
 
+#define STORE_BACKGROUND_MAGIC 'GKCB'
+
+typedef struct _STORE_BACKGROUND {
+    LIST_ENTRY  ListEntry;
+    ULONG       Magic;
+    PKTHREAD    Thread;
+    ULONG       Count;
+} STORE_BACKGROUND, *PSTORE_BACKGROUND;
+
+typedef struct _STORE_PRIORITY_STATISTICS {
+    ULONG       Requests;
+    ULONG       Promoted;
+    ULONGLONG   Latency;
+    ULONGLONG   MaximumLatency;
+} STORE_PRIORITY_STATISTICS, *PSTORE_PRIORITY_STATISTICS;
+
+// Headers of recent requests and responses are recorded to help diagnose
+// slow xenstore traffic. They are dumped by the debug callback.
+#define STORE_RECORD_COUNT  256
+
+typedef struct _STORE_RECORD {
+    LARGE_INTEGER       Time;
+    BOOLEAN             Response;
+    struct xsd_sockmsg  Header;
+} STORE_RECORD, *PSTORE_RECORD;
+
+// Maximum number of normal priority requests that may be sent ahead of
+// a waiting background request
+#define STORE_BACKGROUND_STARVATION_LIMIT   8
+
+#define STORE_DIRECTORY_MAGIC 'RIDS'
+
+struct _XENBUS_STORE_DIRECTORY {
+    LIST_ENTRY                  ListEntry;
+    ULONG                       Magic;
+    PVOID                       Caller;
+    PXENBUS_STORE_TRANSACTION   Transaction;
+    PCHAR                       Path;
+    ULONGLONG                   Generation;
+    ULONG                       Offset;
+    PSTORE_RESPONSE             Response;
+    PCHAR                       Cursor;
+    PCHAR                       End;
+    BOOLEAN                     Complete;
+};
+
 #define STORE_BUFFER_MAGIC 'FFUB'
 
 typedef struct _STORE_BUFFER {
@@ -117,12 +181,22 @@ struct _XENBUS_STORE_CONTEXT {
     struct xenstore_domain_interface    *Shared;
     KSPIN_LOCK                          Lock;
     USHORT                              RequestId;
-    LIST_ENTRY                          SubmittedList;
+    LIST_ENTRY                          SubmittedList[STORE_PRIORITY_COUNT];
+    ULONG                               Starvation;
+    STORE_PRIORITY_STATISTICS           Statistics[STORE_PRIORITY_COUNT];
+    LIST_ENTRY                          BackgroundList;
     LIST_ENTRY                          PendingList;
     LIST_ENTRY                          TransactionList;
     USHORT                              WatchId;
     LIST_ENTRY                          WatchList;
     LIST_ENTRY                          BufferList;
+    LIST_ENTRY                          DirectoryList;
+    LIST_ENTRY                          PathList;
+    BOOLEAN                             DirectoryPartUnsupported;
+    ULONG                               NotifyCount;
+    ULONG                               NotifySuppressed;
+    STORE_RECORD                        Record[STORE_RECORD_COUNT];
+    ULONG                               RecordIndex;
     KDPC                                Dpc;
     STORE_RESPONSE                      Response;
     PXENBUS_EVTCHN_INTERFACE            EvtchnInterface;
@@ -303,23 +377,77 @@ __StoreSendSegment(
     return (Segment->Offset == Segment->Length) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
+static FORCEINLINE VOID
+__StoreRecord(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  BOOLEAN                 Response,
+    IN  struct xsd_sockmsg      *Header
+    )
+{
+    PSTORE_RECORD               Record;
+
+    Record = &Context->Record[Context->RecordIndex++ % STORE_RECORD_COUNT];
+
+    KeQuerySystemTime(&Record->Time);
+    Record->Response = Response;
+    Record->Header = *Header;
+}
+
+static FORCEINLINE BOOLEAN
+__StoreRequestStarted(
+    IN  PSTORE_REQUEST  Request
+    )
+{
+    return (Request->Index != 0 || Request->Segment[0].Offset != 0) ?
+           TRUE :
+           FALSE;
+}
+
+static PSTORE_REQUEST
+StoreNextRequest(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PSTORE_REQUEST              Request[STORE_PRIORITY_COUNT];
+    STORE_PRIORITY              Priority;
+
+    for (Priority = 0; Priority < STORE_PRIORITY_COUNT; Priority++) {
+        PLIST_ENTRY ListEntry;
+
+        if (IsListEmpty(&Context->SubmittedList[Priority])) {
+            Request[Priority] = NULL;
+            continue;
+        }
+
+        ListEntry = Context->SubmittedList[Priority].Flink;
+        Request[Priority] = CONTAINING_RECORD(ListEntry, STORE_REQUEST, ListEntry);
+
+        // A partially sent request must be completed before anything
+        // else is placed on the ring
+        if (__StoreRequestStarted(Request[Priority]))
+            return Request[Priority];
+    }
+
+    if (Request[STORE_PRIORITY_NORMAL] == NULL ||
+        Context->Starvation >= STORE_BACKGROUND_STARVATION_LIMIT)
+        return Request[STORE_PRIORITY_BACKGROUND];
+
+    return Request[STORE_PRIORITY_NORMAL];
+}
+
 static VOID
 StoreSendRequests(
     IN      PXENBUS_STORE_CONTEXT   Context,
     IN OUT  PULONG                  Written
     )
 {
-    if (IsListEmpty(&Context->SubmittedList))
-        return;
-
-    while (!IsListEmpty(&Context->SubmittedList)) {
+    for (;;) {
         PLIST_ENTRY      ListEntry;
         PSTORE_REQUEST   Request;
 
-        ListEntry = Context->SubmittedList.Flink;
-        ASSERT3P(ListEntry, !=, &Context->SubmittedList);
-
-        Request = CONTAINING_RECORD(ListEntry, STORE_REQUEST, ListEntry);
+        Request = StoreNextRequest(Context);
+        if (Request == NULL)
+            break;
 
         ASSERT3U(Request->State, ==, REQUEST_SUBMITTED);
 
@@ -338,9 +466,20 @@ StoreSendRequests(
         if (Request->Index < Request->Count)
             break;
 
-        ListEntry = RemoveHeadList(&Context->SubmittedList);
+        ListEntry = RemoveHeadList(&Context->SubmittedList[Request->Priority]);
         ASSERT3P(ListEntry, ==, &Request->ListEntry);
 
+        __StoreRecord(Context, FALSE, &Request->Header);
+
+        if (Request->Priority == STORE_PRIORITY_BACKGROUND) {
+            if (!IsListEmpty(&Context->SubmittedList[STORE_PRIORITY_NORMAL]))
+                Context->Statistics[STORE_PRIORITY_BACKGROUND].Promoted++;
+
+            Context->Starvation = 0;
+        } else if (!IsListEmpty(&Context->SubmittedList[STORE_PRIORITY_BACKGROUND])) {
+            Context->Starvation++;
+        }
+
         InsertTailList(&Context->PendingList, &Request->ListEntry);
         Request->State = REQUEST_PENDING;
     }
@@ -453,6 +592,7 @@ __StoreVerifyHeader(
     Valid = TRUE;
 
     if (Header->type != XS_DIRECTORY &&
+        Header->type != XS_DIRECTORY_PART &&
         Header->type != XS_READ &&
         Header->type != XS_WATCH &&
         Header->type != XS_UNWATCH &&
@@ -775,6 +915,8 @@ __StoreProcessResponse(
 
     Response = &Context->Response;
 
+    __StoreRecord(Context, TRUE, &Response->Header);
+
     if (__StoreIgnoreHeaderType(Response->Header.type)) {
         Warning("IGNORING RESPONSE TYPE %08X\n", Response->Header.type);
         __StoreResetResponse(Context);
@@ -811,31 +953,61 @@ __StorePoll(
     IN  PXENBUS_STORE_CONTEXT   Context
     )
 {
-    ULONG                       Read;
-    ULONG                       Written;
-    NTSTATUS                    status;
+    struct xenstore_domain_interface    *Shared;
+    XENSTORE_RING_IDX                   req_prod;
+    XENSTORE_RING_IDX                   rsp_cons;
+    ULONG                               Read;
+    ULONG                               Written;
+    BOOLEAN                             Notify;
+    NTSTATUS                            status;
 
     ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
 
+    Shared = Context->Shared;
+
+    // We are the only writer of these indices
+    req_prod = Shared->req_prod;
+    rsp_cons = Shared->rsp_cons;
+
     do {
         Read = Written = 0;
 
         StoreSendRequests(Context, &Written);
-        if (Written != 0)
-            (VOID) EVTCHN(Send,
-                          Context->EvtchnInterface,
-                          Context->Evtchn);
 
         status = __StoreReceiveResponse(Context, &Read);
         if (NT_SUCCESS(status))
             __StoreProcessResponse(Context);
 
-        if (Read != 0)
-            (VOID) EVTCHN(Send,
-                          Context->EvtchnInterface,
-                          Context->Evtchn);
-
     } while (Written != 0 || Read != 0);
+
+    if (Shared->req_prod == req_prod &&
+        Shared->rsp_cons == rsp_cons)
+        return;
+
+    KeMemoryBarrier();
+
+    // There is no req_event on the xenstore ring and nothing orders the
+    // peer's update of req_cons against its next read of req_prod, so
+    // new requests must always be notified. One notification covers
+    // everything sent during this pass.
+    Notify = (Shared->req_prod != req_prod) ? TRUE : FALSE;
+
+    // The peer can only be waiting for space if it filled the ring
+    // relative to some consumer index we published during this pass
+    if (!Notify &&
+        Shared->rsp_cons != rsp_cons) {
+        if ((XENSTORE_RING_IDX)(Shared->rsp_prod - rsp_cons) >= XENSTORE_RING_SIZE)
+            Notify = TRUE;
+        else
+            Context->NotifySuppressed++;
+    }
+
+    if (Notify) {
+        (VOID) EVTCHN(Send,
+                      Context->EvtchnInterface,
+                      Context->Evtchn);
+        Context->NotifyCount++;
+    }
 }
 
 #pragma warning(push)
@@ -866,6 +1038,42 @@ StoreDpc(
 
 #pragma warning(pop)
 
+static FORCEINLINE PSTORE_BACKGROUND
+__StoreFindBackground(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PKTHREAD                Thread
+    )
+{
+    PLIST_ENTRY                 ListEntry;
+
+    for (ListEntry = Context->BackgroundList.Flink;
+         ListEntry != &Context->BackgroundList;
+         ListEntry = ListEntry->Flink) {
+        PSTORE_BACKGROUND   Background;
+
+        Background = CONTAINING_RECORD(ListEntry, STORE_BACKGROUND, ListEntry);
+        ASSERT3U(Background->Magic, ==, STORE_BACKGROUND_MAGIC);
+
+        if (Background->Thread == Thread)
+            return Background;
+    }
+
+    return NULL;
+}
+
+static FORCEINLINE STORE_PRIORITY
+__StoreGetPriority(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    if (IsListEmpty(&Context->BackgroundList))
+        return STORE_PRIORITY_NORMAL;
+
+    return (__StoreFindBackground(Context, KeGetCurrentThread()) != NULL) ?
+           STORE_PRIORITY_BACKGROUND :
+           STORE_PRIORITY_NORMAL;
+}
+
 static PSTORE_RESPONSE
 StoreSubmitRequest(
     IN  PXENBUS_STORE_CONTEXT   Context,
@@ -873,6 +1081,9 @@ StoreSubmitRequest(
     )
 {
     PSTORE_RESPONSE             Response;
+    PSTORE_PRIORITY_STATISTICS  Statistics;
+    LARGE_INTEGER               Completed;
+    ULONGLONG                   Latency;
     KIRQL                       Irql;
 
     ASSERT3U(Request->State, ==, REQUEST_PREPARED);
@@ -883,14 +1094,34 @@ StoreSubmitRequest(
 
     KeAcquireSpinLockAtDpcLevel(&Context->Lock);
 
-    InsertTailList(&Context->SubmittedList, &Request->ListEntry);
+    Request->Priority = __StoreGetPriority(Context);
+    KeQuerySystemTime(&Request->Submitted);
+
+    InsertTailList(&Context->SubmittedList[Request->Priority], &Request->ListEntry);
     Request->State = REQUEST_SUBMITTED;
 
     while (Request->State != REQUEST_COMPLETED) {
         __StorePoll(Context);
+
+        if (Request->State == REQUEST_COMPLETED)
+            break;
+
+        // Drop the lock so that other requests can be queued behind
+        // (or, if they are higher priority, ahead of) this one
+        KeReleaseSpinLockFromDpcLevel(&Context->Lock);
         SchedYield();
+        KeAcquireSpinLockAtDpcLevel(&Context->Lock);
     }
 
+    KeQuerySystemTime(&Completed);
+    Latency = (Completed.QuadPart - Request->Submitted.QuadPart) / 10ull;
+
+    Statistics = &Context->Statistics[Request->Priority];
+
+    Statistics->Requests++;
+    Statistics->Latency += Latency;
+    Statistics->MaximumLatency = __max(Statistics->MaximumLatency, Latency);
+
     KeReleaseSpinLockFromDpcLevel(&Context->Lock);
 
     Response = Request->Response;
@@ -943,14 +1174,13 @@ done:
 }
 
 static FORCEINLINE PSTORE_BUFFER
-__StoreCopyPayload(
+__StoreCopyBuffer(
     IN  PXENBUS_STORE_CONTEXT   Context,
-    IN  PSTORE_RESPONSE         Response,
+    IN  PCHAR                   Data,
+    IN  ULONG                   Length,
     IN  PVOID                   Caller
     )
 {
-    PCHAR                       Data = Response->Segment[RESPONSE_PAYLOAD_SEGMENT].Data;
-    ULONG                       Length = Response->Segment[RESPONSE_PAYLOAD_SEGMENT].Length;
     PSTORE_BUFFER               Buffer;
     KIRQL                       Irql;
     NTSTATUS                    status;
@@ -980,6 +1210,19 @@ fail1:
     return NULL;
 }
 
+static FORCEINLINE PSTORE_BUFFER
+__StoreCopyPayload(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PSTORE_RESPONSE         Response,
+    IN  PVOID                   Caller
+    )
+{
+    return __StoreCopyBuffer(Context,
+                             Response->Segment[RESPONSE_PAYLOAD_SEGMENT].Data,
+                             Response->Segment[RESPONSE_PAYLOAD_SEGMENT].Length,
+                             Caller);
+}
+
 static FORCEINLINE VOID
 __StoreFreePayload(
     IN  PXENBUS_STORE_CONTEXT   Context,
@@ -1019,22 +1262,22 @@ RtlCaptureStackBackTrace(
     );
 
 static NTSTATUS
-StoreRead(
+__StoreRead(
     IN  PXENBUS_STORE_CONTEXT       Context,
     IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
     IN  PCHAR                       Prefix OPTIONAL,
+    IN  ULONG                       PrefixLength,
     IN  PCHAR                       Node,
+    IN  ULONG                       NodeLength,
+    IN  PVOID                       Caller,
     OUT PCHAR                       *Value
     )
 {
-    PVOID                           Caller;
     STORE_REQUEST                   Request;
     PSTORE_RESPONSE                 Response;
     PSTORE_BUFFER                   Buffer;
     NTSTATUS                        status;
 
-    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
-
     RtlZeroMemory(&Request, sizeof (STORE_REQUEST));
 
     if (Prefix == NULL) {
@@ -1042,7 +1285,7 @@ StoreRead(
                                      &Request,
                                      Transaction,
                                      XS_READ,
-                                     Node, strlen(Node),
+                                     Node, NodeLength,
                                      "", 1,
                                      NULL, 0);
     } else {
@@ -1050,9 +1293,9 @@ StoreRead(
                                      &Request,
                                      Transaction,
                                      XS_READ,
-                                     Prefix, strlen(Prefix),
+                                     Prefix, PrefixLength,
                                      "/", 1,
-                                     Node, strlen(Node),
+                                     Node, NodeLength,
                                      "", 1,
                                      NULL, 0);
     }
@@ -1094,12 +1337,37 @@ fail1:
     return status;
 }
 
-NTSTATUS
-StoreWrite(
+static NTSTATUS
+StoreRead(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    OUT PCHAR                       *Value
+    )
+{
+    PVOID                           Caller;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    return __StoreRead(Context,
+                       Transaction,
+                       Prefix,
+                       (Prefix != NULL) ? (ULONG)strlen(Prefix) : 0,
+                       Node,
+                       (ULONG)strlen(Node),
+                       Caller,
+                       Value);
+}
+
+static NTSTATUS
+__StoreWrite(
     IN  PXENBUS_STORE_CONTEXT       Context,
     IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
     IN  PCHAR                       Prefix OPTIONAL,
+    IN  ULONG                       PrefixLength,
     IN  PCHAR                       Node,
+    IN  ULONG                       NodeLength,
     IN  PCHAR                       Value
     )
 {
@@ -1114,7 +1382,7 @@ StoreWrite(
                                      &Request,
                                      Transaction,
                                      XS_WRITE,
-                                     Node, strlen(Node),
+                                     Node, NodeLength,
                                      "", 1,
                                      Value, strlen(Value),
                                      NULL, 0);
@@ -1123,9 +1391,9 @@ StoreWrite(
                                      &Request,
                                      Transaction,
                                      XS_WRITE,
-                                     Prefix, strlen(Prefix),
+                                     Prefix, PrefixLength,
                                      "/", 1,
-                                     Node, strlen(Node),
+                                     Node, NodeLength,
                                      "", 1,
                                      Value, strlen(Value),
                                      NULL, 0);
@@ -1159,6 +1427,24 @@ fail1:
     return status;
 }
 
+NTSTATUS
+StoreWrite(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  PCHAR                       Value
+    )
+{
+    return __StoreWrite(Context,
+                        Transaction,
+                        Prefix,
+                        (Prefix != NULL) ? (ULONG)strlen(Prefix) : 0,
+                        Node,
+                        (ULONG)strlen(Node),
+                        Value);
+}
+
 static FORCEINLINE NTSTATUS
 __StoreVPrintf(
     IN  PXENBUS_STORE_CONTEXT       Context,
@@ -1305,22 +1591,21 @@ fail1:
 }
 
 static NTSTATUS
-StoreDirectory(
+StoreDirectoryLegacy(
     IN  PXENBUS_STORE_CONTEXT       Context,
     IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
     IN  PCHAR                       Prefix OPTIONAL,
     IN  PCHAR                       Node,
-    OUT PCHAR                       *Value
+    OUT PSTORE_RESPONSE             *Response,
+    OUT PULONGLONG                  Generation,
+    OUT PCHAR                       *Data,
+    OUT PULONG                      Length,
+    OUT PBOOLEAN                    Last
     )
 {
-    PVOID                           Caller;
     STORE_REQUEST                   Request;
-    PSTORE_RESPONSE                 Response;
-    PSTORE_BUFFER                   Buffer;
     NTSTATUS                        status;
 
-    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
-
     RtlZeroMemory(&Request, sizeof (STORE_REQUEST));
 
     if (Prefix == NULL) {
@@ -1346,32 +1631,28 @@ StoreDirectory(
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    Response = StoreSubmitRequest(Context, &Request);
+    *Response = StoreSubmitRequest(Context, &Request);
 
     status = STATUS_NO_MEMORY;
-    if (Response == NULL)
+    if (*Response == NULL)
         goto fail2;
 
-    status = __StoreCheckResponse(Response);
+    status = __StoreCheckResponse(*Response);
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    Buffer = __StoreCopyPayload(Context, Response, Caller);
-
-    status = STATUS_NO_MEMORY;
-    if (Buffer == NULL)
-        goto fail4;
-
-    __StoreFreeResponse(Response);
     ASSERT(IsZeroMemory(&Request, sizeof (STORE_REQUEST)));
 
-    *Value = Buffer->Data;
+    *Generation = 0;
+    *Data = (*Response)->Segment[RESPONSE_PAYLOAD_SEGMENT].Data;
+    *Length = (*Response)->Segment[RESPONSE_PAYLOAD_SEGMENT].Length;
+    *Last = TRUE;
 
     return STATUS_SUCCESS;
 
-fail4:
 fail3:
-    __StoreFreeResponse(Response);
+    __StoreFreeResponse(*Response);
+    *Response = NULL;
 
 fail2:
 fail1:
@@ -1380,83 +1661,650 @@ fail1:
     return status;
 }
 
+#define STORE_OFFSET_LENGTH (sizeof ("4294967295"))
+
 static NTSTATUS
-StoreTransactionStart(
+StoreDirectoryPart(
     IN  PXENBUS_STORE_CONTEXT       Context,
-    OUT PXENBUS_STORE_TRANSACTION   *Transaction
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  ULONG                       Offset,
+    OUT PSTORE_RESPONSE             *Response,
+    OUT PULONGLONG                  Generation,
+    OUT PCHAR                       *Data,
+    OUT PULONG                      Length,
+    OUT PBOOLEAN                    Last
     )
 {
+    CHAR                            Token[STORE_OFFSET_LENGTH];
     STORE_REQUEST                   Request;
-    PSTORE_RESPONSE                 Response;
-    KIRQL                           Irql;
+    PCHAR                           Payload;
+    ULONG                           PayloadLength;
+    ULONG                           Index;
     NTSTATUS                        status;
 
-    *Transaction = __StoreAllocate(sizeof (XENBUS_STORE_TRANSACTION));
-
-    status = STATUS_NO_MEMORY;
-    if (*Transaction == NULL)
-        goto fail1;
-
-    (*Transaction)->Magic = STORE_TRANSACTION_MAGIC;
-    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Transaction)->Caller, NULL);    
+    status = RtlStringCbPrintfA(Token,
+                                sizeof (Token),
+                                "%u",
+                                Offset);
+    ASSERT(NT_SUCCESS(status));
 
     RtlZeroMemory(&Request, sizeof (STORE_REQUEST));
 
-    status = StorePrepareRequest(Context,
-                                 &Request,
-                                 NULL,
-                                 XS_TRANSACTION_START,
-                                 "", 1,
-                                 NULL, 0);
-    ASSERT(NT_SUCCESS(status));
+    if (Prefix == NULL) {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_DIRECTORY_PART,
+                                     Node, strlen(Node),
+                                     "", 1,
+                                     Token, strlen(Token),
+                                     "", 1,
+                                     NULL, 0);
+    } else {
+        status = StorePrepareRequest(Context,
+                                     &Request,
+                                     Transaction,
+                                     XS_DIRECTORY_PART,
+                                     Prefix, strlen(Prefix),
+                                     "/", 1,
+                                     Node, strlen(Node),
+                                     "", 1,
+                                     Token, strlen(Token),
+                                     "", 1,
+                                     NULL, 0);
+    }
 
-    Response = StoreSubmitRequest(Context, &Request);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    *Response = StoreSubmitRequest(Context, &Request);
 
     status = STATUS_NO_MEMORY;
-    if (Response == NULL)
+    if (*Response == NULL)
         goto fail2;
 
-    status = __StoreCheckResponse(Response);
+    status = __StoreCheckResponse(*Response);
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    (*Transaction)->Id = (uint32_t)strtoul(Response->Segment[RESPONSE_PAYLOAD_SEGMENT].Data, NULL, 10);
-    ASSERT((*Transaction)->Id != 0);
-
-    __StoreFreeResponse(Response);
     ASSERT(IsZeroMemory(&Request, sizeof (STORE_REQUEST)));
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
-    (*Transaction)->Active = TRUE;
-    InsertTailList(&Context->TransactionList, &(*Transaction)->ListEntry);
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    Payload = (*Response)->Segment[RESPONSE_PAYLOAD_SEGMENT].Data;
+    PayloadLength = (*Response)->Segment[RESPONSE_PAYLOAD_SEGMENT].Length;
 
-    return STATUS_SUCCESS;
+    // The payload starts with the NUL-terminated generation count
+    for (Index = 0; Index < PayloadLength; Index++) {
+        if (Payload[Index] == '\0')
+            break;
+    }
 
-fail3:
-    Error("fail3\n");
+    status = STATUS_UNSUCCESSFUL;
+    if (Index == PayloadLength)
+        goto fail4;
 
-    __StoreFreeResponse(Response);
-    ASSERT(IsZeroMemory(&Request, sizeof (STORE_REQUEST)));
+    *Generation = _strtoui64(Payload, NULL, 10);
 
-    (*Transaction)->Caller = NULL;
-    (*Transaction)->Magic = 0;
+    Payload += Index + 1;
+    PayloadLength -= Index + 1;
 
-    ASSERT(IsZeroMemory(*Transaction, sizeof (XENBUS_STORE_TRANSACTION)));
-    __StoreFree(*Transaction);
+    // Child names cannot be empty so the extra NUL that terminates
+    // the final part is unambiguous
+    if (PayloadLength == 0 ||
+        (Payload[PayloadLength - 1] == '\0' &&
+         (PayloadLength == 1 || Payload[PayloadLength - 2] == '\0'))) {
+        if (PayloadLength != 0)
+            --PayloadLength;
 
-fail2:
-    Error("fail2\n");
+        *Last = TRUE;
+    } else {
+        *Last = FALSE;
+    }
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+    if (PayloadLength != 0 && Payload[PayloadLength - 1] != '\0')
+        goto fail5;
 
-    return status;
-}
+    *Data = Payload;
+    *Length = PayloadLength;
 
-static NTSTATUS
-StoreTransactionEnd(
-    IN  PXENBUS_STORE_CONTEXT       Context,
+    return STATUS_SUCCESS;
+
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    __StoreFreeResponse(*Response);
+    *Response = NULL;
+
+fail2:
+fail1:
+    ASSERT(IsZeroMemory(&Request, sizeof (STORE_REQUEST)));
+
+    return status;
+}
+
+// Fetch the children of a node starting at byte Offset into its child
+// list. XS_DIRECTORY_PART splits large listings across several responses,
+// each tagged with the generation count of the node so that callers can
+// detect modification between parts. If xenstored does not support it
+// then XS_DIRECTORY returns the listing as a single final part.
+static NTSTATUS
+StoreDirectoryChunk(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  ULONG                       Offset,
+    OUT PSTORE_RESPONSE             *Response,
+    OUT PULONGLONG                  Generation,
+    OUT PCHAR                       *Data,
+    OUT PULONG                      Length,
+    OUT PBOOLEAN                    Last
+    )
+{
+    NTSTATUS                        status;
+
+    if (!Context->DirectoryPartUnsupported) {
+        status = StoreDirectoryPart(Context,
+                                    Transaction,
+                                    Prefix,
+                                    Node,
+                                    Offset,
+                                    Response,
+                                    Generation,
+                                    Data,
+                                    Length,
+                                    Last);
+        if (NT_SUCCESS(status))
+            goto done;
+
+        if (status != STATUS_INVALID_PARAMETER &&
+            status != STATUS_NOT_IMPLEMENTED)
+            goto fail1;
+    }
+
+    // A part listing cannot be continued by XS_DIRECTORY (e.g. after
+    // migration to an older host) so the caller must start again
+    status = STATUS_RETRY;
+    if (Offset != 0)
+        goto fail2;
+
+    status = StoreDirectoryLegacy(Context,
+                                  Transaction,
+                                  Prefix,
+                                  Node,
+                                  Response,
+                                  Generation,
+                                  Data,
+                                  Length,
+                                  Last);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    if (!Context->DirectoryPartUnsupported) {
+        Info("XS_DIRECTORY_PART not supported\n");
+        Context->DirectoryPartUnsupported = TRUE;
+    }
+
+done:
+    return STATUS_SUCCESS;
+
+fail3:
+fail2:
+fail1:
+    return status;
+}
+
+static NTSTATUS
+StoreDirectory(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    OUT PCHAR                       *Value
+    )
+{
+    PVOID                           Caller;
+    PCHAR                           Children;
+    ULONG                           Size;
+    ULONG                           Offset;
+    ULONGLONG                       Generation;
+    PSTORE_BUFFER                   Buffer;
+    NTSTATUS                        status;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    Children = NULL;
+    Size = 0;
+
+again:
+    Offset = 0;
+    Generation = 0;
+
+    for (;;) {
+        PSTORE_RESPONSE Response;
+        ULONGLONG       PartGeneration;
+        PCHAR           Data;
+        ULONG           Length;
+        BOOLEAN         Last;
+
+        status = StoreDirectoryChunk(Context,
+                                     Transaction,
+                                     Prefix,
+                                     Node,
+                                     Offset,
+                                     &Response,
+                                     &PartGeneration,
+                                     &Data,
+                                     &Length,
+                                     &Last);
+        if (status == STATUS_RETRY && Offset != 0)
+            goto again;
+
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        if (Offset == 0) {
+            Generation = PartGeneration;
+        } else if (PartGeneration != Generation) {
+            // The node was modified between parts so start again
+            __StoreFreeResponse(Response);
+            goto again;
+        }
+
+        if (Offset + Length > Size) {
+            PCHAR   New;
+            ULONG   NewSize;
+
+            NewSize = __max(Size * 2, Offset + Length);
+
+            New = __StoreAllocate(NewSize);
+
+            status = STATUS_NO_MEMORY;
+            if (New == NULL) {
+                __StoreFreeResponse(Response);
+                goto fail2;
+            }
+
+            if (Children != NULL) {
+                RtlCopyMemory(New, Children, Offset);
+                __StoreFree(Children);
+            }
+
+            Children = New;
+            Size = NewSize;
+        }
+
+        RtlCopyMemory(Children + Offset, Data, Length);
+        Offset += Length;
+
+        __StoreFreeResponse(Response);
+
+        if (Last)
+            break;
+    }
+
+    Buffer = __StoreCopyBuffer(Context, Children, Offset, Caller);
+
+    status = STATUS_NO_MEMORY;
+    if (Buffer == NULL)
+        goto fail3;
+
+    if (Children != NULL)
+        __StoreFree(Children);
+
+    *Value = Buffer->Data;
+
+    return STATUS_SUCCESS;
+
+fail3:
+fail2:
+fail1:
+    if (Children != NULL)
+        __StoreFree(Children);
+
+    return status;
+}
+
+static NTSTATUS
+StoreDirectoryOpen(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    OUT PXENBUS_STORE_DIRECTORY     *Directory
+    )
+{
+    ULONG                           Length;
+    PCHAR                           Path;
+    KIRQL                           Irql;
+    NTSTATUS                        status;
+
+    *Directory = __StoreAllocate(sizeof (XENBUS_STORE_DIRECTORY));
+
+    status = STATUS_NO_MEMORY;
+    if (*Directory == NULL)
+        goto fail1;
+
+    (*Directory)->Magic = STORE_DIRECTORY_MAGIC;
+    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Directory)->Caller, NULL);    
+
+    if (Prefix == NULL)
+        Length = (ULONG)strlen(Node) + sizeof (CHAR);
+    else
+        Length = (ULONG)strlen(Prefix) + 1 + (ULONG)strlen(Node) + sizeof (CHAR);
+
+    Path = __StoreAllocate(Length);
+
+    status = STATUS_NO_MEMORY;
+    if (Path == NULL)
+        goto fail2;
+
+    status = (Prefix == NULL) ?
+             RtlStringCbPrintfA(Path, Length, "%s", Node) :
+             RtlStringCbPrintfA(Path, Length, "%s/%s", Prefix, Node);
+    ASSERT(NT_SUCCESS(status));
+
+    (*Directory)->Path = Path;
+    (*Directory)->Transaction = Transaction;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    InsertTailList(&Context->DirectoryList, &(*Directory)->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    (*Directory)->Caller = NULL;
+    (*Directory)->Magic = 0;
+
+    ASSERT(IsZeroMemory(*Directory, sizeof (XENBUS_STORE_DIRECTORY)));
+    __StoreFree(*Directory);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static FORCEINLINE VOID
+__StoreDirectoryRewind(
+    IN  PXENBUS_STORE_DIRECTORY Directory
+    )
+{
+    if (Directory->Response != NULL) {
+        __StoreFreeResponse(Directory->Response);
+        Directory->Response = NULL;
+    }
+
+    Directory->Cursor = NULL;
+    Directory->End = NULL;
+    Directory->Complete = FALSE;
+    Directory->Offset = 0;
+    Directory->Generation = 0;
+}
+
+// Children are returned one at a time and each name remains valid until
+// the next call to DirectoryNext or DirectoryClose. STATUS_NO_MORE_ENTRIES
+// is returned at the end of the listing. If the node is modified during
+// enumeration then STATUS_RETRY is returned and the iterator is rewound,
+// so that the next call returns the first child of the new listing.
+static NTSTATUS
+StoreDirectoryNext(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_DIRECTORY     Directory,
+    OUT PCHAR                       *Child
+    )
+{
+    NTSTATUS                        status;
+
+    ASSERT3U(Directory->Magic, ==, STORE_DIRECTORY_MAGIC);
+
+    for (;;) {
+        PSTORE_RESPONSE Response;
+        ULONGLONG       Generation;
+        PCHAR           Data;
+        ULONG           Length;
+        BOOLEAN         Last;
+
+        if (Directory->Cursor < Directory->End) {
+            *Child = Directory->Cursor;
+            Directory->Cursor += strlen(Directory->Cursor) + 1;
+
+            ASSERT3P(Directory->Cursor, <=, Directory->End);
+            return STATUS_SUCCESS;
+        }
+
+        status = STATUS_NO_MORE_ENTRIES;
+        if (Directory->Complete)
+            goto done;
+
+        status = StoreDirectoryChunk(Context,
+                                     Directory->Transaction,
+                                     NULL,
+                                     Directory->Path,
+                                     Directory->Offset,
+                                     &Response,
+                                     &Generation,
+                                     &Data,
+                                     &Length,
+                                     &Last);
+        if (status == STATUS_RETRY && Directory->Offset != 0) {
+            __StoreDirectoryRewind(Directory);
+            goto done;
+        }
+
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        if (Directory->Offset == 0) {
+            Directory->Generation = Generation;
+        } else if (Generation != Directory->Generation) {
+            __StoreFreeResponse(Response);
+            __StoreDirectoryRewind(Directory);
+
+            status = STATUS_RETRY;
+            goto done;
+        }
+
+        if (Directory->Response != NULL)
+            __StoreFreeResponse(Directory->Response);
+
+        Directory->Response = Response;
+        Directory->Cursor = Data;
+        Directory->End = Data + Length;
+        Directory->Offset += Length;
+        Directory->Complete = Last;
+    }
+
+done:
+    return status;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+StoreDirectoryClose(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_DIRECTORY     Directory
+    )
+{
+    KIRQL                           Irql;
+
+    ASSERT3U(Directory->Magic, ==, STORE_DIRECTORY_MAGIC);
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    RemoveEntryList(&Directory->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    RtlZeroMemory(&Directory->ListEntry, sizeof (LIST_ENTRY));
+
+    __StoreDirectoryRewind(Directory);
+
+    __StoreFree(Directory->Path);
+    Directory->Path = NULL;
+
+    Directory->Transaction = NULL;
+
+    Directory->Caller = NULL;
+    Directory->Magic = 0;
+
+    ASSERT(IsZeroMemory(Directory, sizeof (XENBUS_STORE_DIRECTORY)));
+    __StoreFree(Directory);
+}
+
+// Requests made by the current thread are queued behind any normal
+// priority requests until a matching call to BackgroundEnd. Calls may be
+// nested. If memory cannot be allocated then requests simply remain at
+// normal priority.
+static VOID
+StoreBackgroundStart(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PKTHREAD                    Thread = KeGetCurrentThread();
+    PSTORE_BACKGROUND           Background;
+    PSTORE_BACKGROUND           New;
+    KIRQL                       Irql;
+
+    New = __StoreAllocate(sizeof (STORE_BACKGROUND));
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    Background = __StoreFindBackground(Context, Thread);
+    if (Background == NULL && New != NULL) {
+        Background = New;
+        New = NULL;
+
+        Background->Magic = STORE_BACKGROUND_MAGIC;
+        Background->Thread = Thread;
+        InsertTailList(&Context->BackgroundList, &Background->ListEntry);
+    }
+
+    if (Background != NULL)
+        Background->Count++;
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    if (New != NULL)
+        __StoreFree(New);
+}
+
+static VOID
+StoreBackgroundEnd(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PSTORE_BACKGROUND           Background;
+    KIRQL                       Irql;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    Background = __StoreFindBackground(Context, KeGetCurrentThread());
+    if (Background != NULL && --Background->Count == 0)
+        RemoveEntryList(&Background->ListEntry);
+    else
+        Background = NULL;
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    if (Background == NULL)
+        return;
+
+    RtlZeroMemory(&Background->ListEntry, sizeof (LIST_ENTRY));
+    Background->Thread = NULL;
+    Background->Magic = 0;
+
+    ASSERT(IsZeroMemory(Background, sizeof (STORE_BACKGROUND)));
+    __StoreFree(Background);
+}
+
+static NTSTATUS
+StoreTransactionStart(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    OUT PXENBUS_STORE_TRANSACTION   *Transaction
+    )
+{
+    STORE_REQUEST                   Request;
+    PSTORE_RESPONSE                 Response;
+    KIRQL                           Irql;
+    NTSTATUS                        status;
+
+    *Transaction = __StoreAllocate(sizeof (XENBUS_STORE_TRANSACTION));
+
+    status = STATUS_NO_MEMORY;
+    if (*Transaction == NULL)
+        goto fail1;
+
+    (*Transaction)->Magic = STORE_TRANSACTION_MAGIC;
+    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Transaction)->Caller, NULL);    
+
+    RtlZeroMemory(&Request, sizeof (STORE_REQUEST));
+
+    status = StorePrepareRequest(Context,
+                                 &Request,
+                                 NULL,
+                                 XS_TRANSACTION_START,
+                                 "", 1,
+                                 NULL, 0);
+    ASSERT(NT_SUCCESS(status));
+
+    Response = StoreSubmitRequest(Context, &Request);
+
+    status = STATUS_NO_MEMORY;
+    if (Response == NULL)
+        goto fail2;
+
+    status = __StoreCheckResponse(Response);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    (*Transaction)->Id = (uint32_t)strtoul(Response->Segment[RESPONSE_PAYLOAD_SEGMENT].Data, NULL, 10);
+    ASSERT((*Transaction)->Id != 0);
+
+    __StoreFreeResponse(Response);
+    ASSERT(IsZeroMemory(&Request, sizeof (STORE_REQUEST)));
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    (*Transaction)->Active = TRUE;
+    InsertTailList(&Context->TransactionList, &(*Transaction)->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    __StoreFreeResponse(Response);
+    ASSERT(IsZeroMemory(&Request, sizeof (STORE_REQUEST)));
+
+    (*Transaction)->Caller = NULL;
+    (*Transaction)->Magic = 0;
+
+    ASSERT(IsZeroMemory(*Transaction, sizeof (XENBUS_STORE_TRANSACTION)));
+    __StoreFree(*Transaction);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+StoreTransactionEnd(
+    IN  PXENBUS_STORE_CONTEXT       Context,
     IN  PXENBUS_STORE_TRANSACTION   Transaction,
     IN  BOOLEAN                     Commit
     )
@@ -1530,10 +2378,13 @@ fail1:
 }
 
 static NTSTATUS
-StoreWatch(
+__StoreWatch(
     IN  PXENBUS_STORE_CONTEXT   Context,
     IN  PCHAR                   Prefix OPTIONAL,
+    IN  ULONG                   PrefixLength,
     IN  PCHAR                   Node,
+    IN  ULONG                   NodeLength,
+    IN  PVOID                   Caller,
     IN  PKEVENT                 Event,
     OUT PXENBUS_STORE_WATCH     *Watch
     )
@@ -1553,24 +2404,27 @@ StoreWatch(
         goto fail1;
 
     (*Watch)->Magic = STORE_WATCH_MAGIC;
-    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Watch)->Caller, NULL);    
+    (*Watch)->Caller = Caller;
 
     if (Prefix == NULL)
-        Length = (ULONG)strlen(Node) + sizeof (CHAR);
+        Length = NodeLength;
     else
-        Length = (ULONG)strlen(Prefix) + 1 + (ULONG)strlen(Node) + sizeof (CHAR);
+        Length = PrefixLength + 1 + NodeLength;
 
-    Path = __StoreAllocate(Length);
+    Path = __StoreAllocate(Length + sizeof (CHAR));
 
     status = STATUS_NO_MEMORY;
     if (Path == NULL)
         goto fail2;
 
-    status = (Prefix == NULL) ?
-             RtlStringCbPrintfA(Path, Length, "%s", Node) :
-             RtlStringCbPrintfA(Path, Length, "%s/%s", Prefix, Node);
-    ASSERT(NT_SUCCESS(status));
-    
+    if (Prefix != NULL) {
+        RtlCopyMemory(Path, Prefix, PrefixLength);
+        Path[PrefixLength] = '/';
+    }
+
+    RtlCopyMemory(Path + Length - NodeLength, Node, NodeLength);
+    ASSERT3U(Path[Length], ==, '\0');
+
     (*Watch)->Path = Path;
     (*Watch)->Event = Event;
 
@@ -1594,7 +2448,7 @@ StoreWatch(
                                  &Request,
                                  NULL,
                                  XS_WATCH,
-                                 Path, strlen(Path),
+                                 Path, Length,
                                  "", 1,
                                  Token, strlen(Token), 
                                  "", 1,
@@ -1654,6 +2508,173 @@ fail1:
     return status;
 }
 
+static NTSTATUS
+StoreWatch(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node,
+    IN  PKEVENT                 Event,
+    OUT PXENBUS_STORE_WATCH     *Watch
+    )
+{
+    PVOID                       Caller;
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    return __StoreWatch(Context,
+                        Prefix,
+                        (Prefix != NULL) ? (ULONG)strlen(Prefix) : 0,
+                        Node,
+                        (ULONG)strlen(Node),
+                        Caller,
+                        Event,
+                        Watch);
+}
+
+static NTSTATUS
+StorePathOpen(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PCHAR                   Prefix OPTIONAL,
+    IN  PCHAR                   Node,
+    OUT PXENBUS_STORE_PATH      *Path
+    )
+{
+    ULONG                       PrefixLength;
+    ULONG                       NodeLength;
+    ULONG                       Length;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    PrefixLength = (Prefix != NULL) ? (ULONG)strlen(Prefix) : 0;
+    NodeLength = (ULONG)strlen(Node);
+
+    Length = (Prefix != NULL) ? PrefixLength + 1 + NodeLength : NodeLength;
+
+    *Path = __StoreAllocate(FIELD_OFFSET(XENBUS_STORE_PATH, Data) +
+                            Length + sizeof (CHAR));
+
+    status = STATUS_NO_MEMORY;
+    if (*Path == NULL)
+        goto fail1;
+
+    (*Path)->Magic = STORE_PATH_MAGIC;
+    (VOID) RtlCaptureStackBackTrace(1, 1, &(*Path)->Caller, NULL);    
+
+    if (Prefix != NULL) {
+        RtlCopyMemory((*Path)->Data, Prefix, PrefixLength);
+        (*Path)->Data[PrefixLength] = '/';
+    }
+
+    RtlCopyMemory((*Path)->Data + Length - NodeLength, Node, NodeLength);
+    ASSERT3U((*Path)->Data[Length], ==, '\0');
+
+    (*Path)->Length = Length;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    InsertTailList(&Context->PathList, &(*Path)->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+StorePathClose(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_PATH      Path
+    )
+{
+    KIRQL                       Irql;
+
+    ASSERT3U(Path->Magic, ==, STORE_PATH_MAGIC);
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+    RemoveEntryList(&Path->ListEntry);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    RtlZeroMemory(&Path->ListEntry, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(Path->Data, Path->Length);
+    Path->Length = 0;
+
+    Path->Caller = NULL;
+    Path->Magic = 0;
+
+    ASSERT(IsZeroMemory(Path, FIELD_OFFSET(XENBUS_STORE_PATH, Data) + sizeof (CHAR)));
+    __StoreFree(Path);
+}
+
+static NTSTATUS
+StorePathRead(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PXENBUS_STORE_PATH          Path,
+    OUT PCHAR                       *Value
+    )
+{
+    PVOID                           Caller;
+
+    ASSERT3U(Path->Magic, ==, STORE_PATH_MAGIC);
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    return __StoreRead(Context,
+                       Transaction,
+                       NULL,
+                       0,
+                       Path->Data,
+                       Path->Length,
+                       Caller,
+                       Value);
+}
+
+static NTSTATUS
+StorePathWrite(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PXENBUS_STORE_PATH          Path,
+    IN  PCHAR                       Value
+    )
+{
+    ASSERT3U(Path->Magic, ==, STORE_PATH_MAGIC);
+
+    return __StoreWrite(Context,
+                        Transaction,
+                        NULL,
+                        0,
+                        Path->Data,
+                        Path->Length,
+                        Value);
+}
+
+static NTSTATUS
+StorePathWatch(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_PATH      Path,
+    IN  PKEVENT                 Event,
+    OUT PXENBUS_STORE_WATCH     *Watch
+    )
+{
+    PVOID                       Caller;
+
+    ASSERT3U(Path->Magic, ==, STORE_PATH_MAGIC);
+
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Caller, NULL);    
+
+    return __StoreWatch(Context,
+                        NULL,
+                        0,
+                        Path->Data,
+                        Path->Length,
+                        Caller,
+                        Event,
+                        Watch);
+}
+
 static NTSTATUS
 StoreUnwatch(
     IN  PXENBUS_STORE_CONTEXT   Context,
@@ -1898,6 +2919,9 @@ StoreSuspendCallbackLate(
     __StoreResetResponse(Context);
     __StoreEnable(Context);
 
+    // We may have migrated to a host with a different xenstored
+    Context->DirectoryPartUnsupported = FALSE;
+
     for (ListEntry = Context->WatchList.Flink;
          ListEntry != &(Context->WatchList);
          ListEntry = ListEntry->Flink) {
@@ -1911,6 +2935,27 @@ StoreSuspendCallbackLate(
     KeReleaseSpinLock(&Context->Lock, Irql);
 }
 
+static FORCEINLINE PCHAR
+__StorePriorityName(
+    IN  STORE_PRIORITY  Priority
+    )
+{
+#define _STORE_PRIORITY_NAME(_Priority) \
+    case STORE_PRIORITY_ ## _Priority:  \
+        return #_Priority;
+
+    switch (Priority) {
+    _STORE_PRIORITY_NAME(NORMAL);
+    _STORE_PRIORITY_NAME(BACKGROUND);
+    default:
+        break;
+    }
+
+    return "UNKNOWN";
+
+#undef  _STORE_PRIORITY_NAME
+}
+
 static VOID
 StoreDebugCallback(
     IN  PVOID                           Argument,
@@ -1918,6 +2963,7 @@ StoreDebugCallback(
     )
 {
     PXENBUS_STORE_CONTEXT               Context = Argument;
+    STORE_PRIORITY                      Priority;
 
     DEBUG(Printf,
           Context->DebugInterface,
@@ -1925,6 +2971,12 @@ StoreDebugCallback(
           "Pfn = %p\n",
           (PVOID)Context->Pfn);
 
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "XS_DIRECTORY_PART: %s\n",
+          (Context->DirectoryPartUnsupported) ? "UNSUPPORTED" : "SUPPORTED");
+
     if (!Crashing) {
         struct xenstore_domain_interface    *Shared;
 
@@ -1945,6 +2997,57 @@ StoreDebugCallback(
               Shared->rsp_prod);
     }
 
+    DEBUG(Printf,
+          Context->DebugInterface,
+          Context->DebugCallback,
+          "Notifications: SENT = %u SUPPRESSED = %u\n",
+          Context->NotifyCount,
+          Context->NotifySuppressed);
+
+    for (Priority = 0; Priority < STORE_PRIORITY_COUNT; Priority++) {
+        PSTORE_PRIORITY_STATISTICS  Statistics = &Context->Statistics[Priority];
+
+        DEBUG(Printf,
+              Context->DebugInterface,
+              Context->DebugCallback,
+              "%s: Requests = %u Promoted = %u Latency = %lluus (max %lluus)\n",
+              __StorePriorityName(Priority),
+              Statistics->Requests,
+              Statistics->Promoted,
+              (Statistics->Requests != 0) ?
+              Statistics->Latency / Statistics->Requests :
+              0ull,
+              Statistics->MaximumLatency);
+    }
+
+    if (Context->RecordIndex != 0) {
+        ULONG   Index;
+
+        DEBUG(Printf,
+              Context->DebugInterface,
+              Context->DebugCallback,
+              "RECORDS: (TIME DIRECTION TYPE REQ_ID TX_ID LEN)\n");
+
+        Index = (Context->RecordIndex > STORE_RECORD_COUNT) ?
+                Context->RecordIndex - STORE_RECORD_COUNT :
+                0;
+
+        while (Index != Context->RecordIndex) {
+            PSTORE_RECORD   Record = &Context->Record[Index++ % STORE_RECORD_COUNT];
+
+            DEBUG(Printf,
+                  Context->DebugInterface,
+                  Context->DebugCallback,
+                  "- %016llx %s %u %08x %08x %u\n",
+                  Record->Time.QuadPart,
+                  (Record->Response) ? "RSP" : "REQ",
+                  Record->Header.type,
+                  Record->Header.req_id,
+                  Record->Header.tx_id,
+                  Record->Header.len);
+        }
+    }
+
     if (!IsListEmpty(&Context->BufferList)) {
         PLIST_ENTRY ListEntry;
 
@@ -1983,6 +3086,46 @@ StoreDebugCallback(
         }
     }
 
+    if (!IsListEmpty(&Context->DirectoryList)) {
+        PLIST_ENTRY ListEntry;
+
+        DEBUG(Printf,
+              Context->DebugInterface,
+              Context->DebugCallback,
+              "DIRECTORIES:\n");
+
+        for (ListEntry = Context->DirectoryList.Flink;
+             ListEntry != &(Context->DirectoryList);
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_STORE_DIRECTORY Directory;
+            PCHAR                   Name;
+            ULONG_PTR               Offset;
+
+            Directory = CONTAINING_RECORD(ListEntry, XENBUS_STORE_DIRECTORY, ListEntry);
+
+            ModuleLookup((ULONG_PTR)Directory->Caller, &Name, &Offset);
+
+            if (Name != NULL) {
+                DEBUG(Printf,
+                      Context->DebugInterface,
+                      Context->DebugCallback,
+                      "- ON %s BY %s + %p [%u]\n",
+                      Directory->Path,
+                      Name,
+                      (PVOID)Offset,
+                      Directory->Offset);
+            } else {
+                DEBUG(Printf,
+                      Context->DebugInterface,
+                      Context->DebugCallback,
+                      "- ON %s BY %p [%u]\n",
+                      Directory->Path,
+                      Directory->Caller,
+                      Directory->Offset);
+            }
+        }
+    }
+
     if (!IsListEmpty(&Context->WatchList)) {
         PLIST_ENTRY ListEntry;
 
@@ -2100,7 +3243,9 @@ StoreInitialize(
     KeInitializeSpinLock(&Context->Lock);
 
     Context->RequestId = (USHORT)__rdtsc();
-    InitializeListHead(&Context->SubmittedList);
+    InitializeListHead(&Context->SubmittedList[STORE_PRIORITY_NORMAL]);
+    InitializeListHead(&Context->SubmittedList[STORE_PRIORITY_BACKGROUND]);
+    InitializeListHead(&Context->BackgroundList);
     InitializeListHead(&Context->PendingList);
 
     InitializeListHead(&Context->TransactionList);
@@ -2110,6 +3255,10 @@ StoreInitialize(
 
     InitializeListHead(&Context->BufferList);
 
+    InitializeListHead(&Context->DirectoryList);
+
+    InitializeListHead(&Context->PathList);
+
     KeInitializeDpc(&Context->Dpc, StoreDpc, Context);
 
     Context->EvtchnInterface = FdoGetEvtchnInterface(Fdo);
@@ -2195,6 +3344,18 @@ fail3:
 
     RtlZeroMemory(&Context->Response, sizeof (STORE_RESPONSE));
 
+    RtlZeroMemory(Context->Record, sizeof (STORE_RECORD) * STORE_RECORD_COUNT);
+    Context->RecordIndex = 0;
+
+    Context->NotifySuppressed = 0;
+    Context->NotifyCount = 0;
+
+    Context->DirectoryPartUnsupported = FALSE;
+
+    RtlZeroMemory(&Context->PathList, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(&Context->DirectoryList, sizeof (LIST_ENTRY));
+
     RtlZeroMemory(&Context->BufferList, sizeof (LIST_ENTRY));
 
     RtlZeroMemory(&Context->WatchList, sizeof (LIST_ENTRY));
@@ -2205,7 +3366,10 @@ fail3:
 
     RtlZeroMemory(&Context->PendingList, sizeof (LIST_ENTRY));
 
-    RtlZeroMemory(&Context->SubmittedList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Context->BackgroundList, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(&Context->SubmittedList,
+                  sizeof (LIST_ENTRY) * STORE_PRIORITY_COUNT);
 
     Context->RequestId = 0;
 
@@ -2246,6 +3410,15 @@ StoreTeardown(
     if (!IsListEmpty(&Context->BufferList))
         BUG("OUTSTANDING BUFFER");
 
+    if (!IsListEmpty(&Context->DirectoryList))
+        BUG("OUTSTANDING DIRECTORIES");
+
+    if (!IsListEmpty(&Context->BackgroundList))
+        BUG("OUTSTANDING BACKGROUND THREADS");
+
+    if (!IsListEmpty(&Context->PathList))
+        BUG("OUTSTANDING PATHS");
+
     DEBUG(Deregister,
           Context->DebugInterface,
           Context->DebugCallback);
@@ -2276,6 +3449,18 @@ StoreTeardown(
 
     RtlZeroMemory(&Context->Response, sizeof (STORE_RESPONSE));
 
+    RtlZeroMemory(Context->Record, sizeof (STORE_RECORD) * STORE_RECORD_COUNT);
+    Context->RecordIndex = 0;
+
+    Context->NotifySuppressed = 0;
+    Context->NotifyCount = 0;
+
+    Context->DirectoryPartUnsupported = FALSE;
+
+    RtlZeroMemory(&Context->PathList, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(&Context->DirectoryList, sizeof (LIST_ENTRY));
+
     RtlZeroMemory(&Context->BufferList, sizeof (LIST_ENTRY));
 
     RtlZeroMemory(&Context->WatchList, sizeof (LIST_ENTRY));
@@ -2287,8 +3472,16 @@ StoreTeardown(
     ASSERT(IsListEmpty(&Context->PendingList));
     RtlZeroMemory(&Context->PendingList, sizeof (LIST_ENTRY));
 
-    ASSERT(IsListEmpty(&Context->SubmittedList));
-    RtlZeroMemory(&Context->SubmittedList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(Context->Statistics,
+                  sizeof (STORE_PRIORITY_STATISTICS) * STORE_PRIORITY_COUNT);
+    Context->Starvation = 0;
+
+    RtlZeroMemory(&Context->BackgroundList, sizeof (LIST_ENTRY));
+
+    ASSERT(IsListEmpty(&Context->SubmittedList[STORE_PRIORITY_BACKGROUND]));
+    ASSERT(IsListEmpty(&Context->SubmittedList[STORE_PRIORITY_NORMAL]));
+    RtlZeroMemory(&Context->SubmittedList,
+                  sizeof (LIST_ENTRY) * STORE_PRIORITY_COUNT);
 
     Context->RequestId = 0;
 